@@ -7,20 +7,33 @@ A utility for writing bit strings to an ostream
 #ifndef _BITBUFFER_HPP
 #define _BITBUFFER_HPP
 
-#define BITBUFFER_T unsigned char
-
 #include <iostream>
 #include <cstdint>
 #include <vector>
 #include <utility>
+#include <new>
 #include <map>
 #include <string>
 #include <exception>
+#include <cstring>
+#include <algorithm>
 
 #ifdef _MSC_VER
 #include <intrin.h>
 #endif
 
+/* SIMD kernels are built with per-function targets and chosen at runtime */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BITUTIL_X86_64
+#endif
+
+/* Clang reverses bits in one instruction where the target has one, such as rbit on ARM */
+#if defined(__clang__) && defined(__has_builtin)
+#if __has_builtin(__builtin_bitreverse32)
+#define BITUTIL_BITREVERSE
+#endif
+#endif
+
 namespace BitBuffer {
     
     /*
@@ -31,40 +44,432 @@ namespace BitBuffer {
         LSB = 1
     };
     
+    /* Thrown when invalid arguments or state arise for bit ops */
+    class BitBufferException : public std::exception {
+        private:
+            std::string message;
+        public:
+            BitBufferException(std::string message) : message{message} {};
+            virtual const char* what();
+    };
+    
     /*
-    A wrapper around an ostream that can perform bitwise writes
+    A reasonable block size, in bytes, for buffered bit buffers
+    */
+    constexpr size_t BLOCK_SIZE = 4096;
+    
+    /*
+    Reverse the order of the low bits of a value
+    
+    value: Bits to reverse
+    bits: Number of low bits of value to reverse, up to 32
+    returns the reversed bits, with any higher bits of value dropped
+    */
+    inline std::uint32_t reverseBits(std::uint32_t value, size_t bits);
+    
+    /* Byte order helpers, written out so compilers turn them into single loads and stores */
+    inline std::uint64_t loadBe64(const std::uint8_t *src)
+    {
+        return (std::uint64_t{src[0]} << 56) | (std::uint64_t{src[1]} << 48) | (std::uint64_t{src[2]} << 40) |
+            (std::uint64_t{src[3]} << 32) | (std::uint64_t{src[4]} << 24) | (std::uint64_t{src[5]} << 16) |
+            (std::uint64_t{src[6]} << 8) | std::uint64_t{src[7]};
+    }
+    
+    inline std::uint64_t loadLe64(const std::uint8_t *src)
+    {
+        return std::uint64_t{src[0]} | (std::uint64_t{src[1]} << 8) | (std::uint64_t{src[2]} << 16) |
+            (std::uint64_t{src[3]} << 24) | (std::uint64_t{src[4]} << 32) | (std::uint64_t{src[5]} << 40) |
+            (std::uint64_t{src[6]} << 48) | (std::uint64_t{src[7]} << 56);
+    }
+    
+    inline void storeBe64(std::uint8_t *dst, std::uint64_t word)
+    {
+        dst[0] = word >> 56;
+        dst[1] = word >> 48;
+        dst[2] = word >> 40;
+        dst[3] = word >> 32;
+        dst[4] = word >> 24;
+        dst[5] = word >> 16;
+        dst[6] = word >> 8;
+        dst[7] = word;
+    }
+    
+    inline void storeLe64(std::uint8_t *dst, std::uint64_t word)
+    {
+        dst[0] = word;
+        dst[1] = word >> 8;
+        dst[2] = word >> 16;
+        dst[3] = word >> 24;
+        dst[4] = word >> 32;
+        dst[5] = word >> 40;
+        dst[6] = word >> 48;
+        dst[7] = word >> 56;
+    }
+    
+    /* Reverse the bits within each byte of a word */
+    inline std::uint64_t reverseEachByte(std::uint64_t word)
+    {
+        word = ((word & 0xF0F0F0F0F0F0F0F0) >> 4) | ((word & 0x0F0F0F0F0F0F0F0F) << 4);
+        word = ((word & 0xCCCCCCCCCCCCCCCC) >> 2) | ((word & 0x3333333333333333) << 2);
+        word = ((word & 0xAAAAAAAAAAAAAAAA) >> 1) | ((word & 0x5555555555555555) << 1);
+        return word;
+    }
+    
+    /*
+    Sinks take completed bytes from a bit writer. A sink provides:
+    reserve(bytes): returns room for up to 8 bytes to be written
+    commit(bytes): marks that many reserved bytes as written
+    put(data, bytes): writes any number of bytes at once
+    flush(): hands everything committed on to the destination
+    eager(): true if every completed byte must be handed over as soon as it is complete
+    BitWriter works with any class providing these, not only the sinks below
+    */
+    
+    /*
+    Sink gathering completed bytes in blocks before writing them to an ostream
     */
-    class BitBufferOut {
+    class StreamSink {
         private:
             std::ostream& stream;
-            BITBUFFER_T building;
-            int index;
-            BitOrder order;
-            void push();
-                        
-            /* Disallow copying */
-            BitBufferOut(const BitBufferOut& other);
+            size_t blockSize;
+            size_t staged;
+            std::vector<std::uint8_t> block;
+            void drain();
+        public:
+            /*
+            stream: Destination of the bytes
+            blockSize: Number of bytes to gather before writing them.
+                0 writes and flushes every completed byte immediately
+            */
+            StreamSink(std::ostream& stream, size_t blockSize) :
+                stream{stream},
+                blockSize{blockSize},
+                staged{0},
+                block(blockSize + sizeof(std::uint64_t)) {}
+            
+            inline bool eager() const
+            {
+                return blockSize == 0;
+            }
+            
+            /*
+            Always has room, as commit drains the block before it fills the 8 bytes kept past blockSize
+            */
+            inline std::uint8_t* reserve(size_t)
+            {
+                return block.data() + staged;
+            }
+            
+            inline void commit(size_t bytes)
+            {
+                staged += bytes;
+                if (staged >= blockSize) {
+                    drain();
+                    if (blockSize == 0) {
+                        stream.flush();
+                    }
+                }
+            }
+            
+            void put(const std::uint8_t *data, size_t bytes);
+            
+            void flush();
+    };
+    
+    /*
+    Sink writing straight into caller-provided memory of a fixed capacity
+    */
+    class SpanSink {
+        private:
+            std::uint8_t *data;
+            size_t capacity;
+            size_t size;
+        public:
+            SpanSink(std::uint8_t *data, size_t capacity) :
+                data{data},
+                capacity{capacity},
+                size{0} {}
+            
+            inline bool eager() const
+            {
+                return false;
+            }
+            
+            /*
+            Throws BitBufferException if the span cannot hold the bytes
+            */
+            inline std::uint8_t* reserve(size_t bytes)
+            {
+                if (bytes > capacity - size) {
+                    throw BitBufferException("span is full");
+                }
+                return data + size;
+            }
+            
+            inline void commit(size_t bytes)
+            {
+                size += bytes;
+            }
+            
+            inline void put(const std::uint8_t *bytes, size_t n)
+            {
+                if (n > capacity - size) {
+                    throw BitBufferException("span is full");
+                }
+                std::memcpy(data + size, bytes, n);
+                size += n;
+            }
+            
+            inline void flush() {}
+            
+            /*
+            returns the number of bytes written to the span
+            */
+            inline size_t written() const
+            {
+                return size;
+            }
+    };
+    
+    /*
+    Sink appending to a vector, which it grows ahead of the bytes written.
+    The vector holds exactly the bytes written after each flush
+    */
+    class VectorSink {
+        private:
+            std::vector<std::uint8_t>& vec;
+            size_t size;
+            void grow(size_t bytes);
+        public:
+            VectorSink(std::vector<std::uint8_t>& vec) :
+                vec{vec},
+                size{vec.size()} {}
+            
+            inline bool eager() const
+            {
+                return false;
+            }
+            
+            inline std::uint8_t* reserve(size_t bytes)
+            {
+                if (vec.size() - size < bytes) {
+                    grow(bytes);
+                }
+                return vec.data() + size;
+            }
+            
+            inline void commit(size_t bytes)
+            {
+                size += bytes;
+            }
+            
+            inline void put(const std::uint8_t *data, size_t bytes)
+            {
+                if (vec.size() - size < bytes) {
+                    grow(bytes);
+                }
+                std::memcpy(vec.data() + size, data, bytes);
+                size += bytes;
+            }
             
+            inline void flush()
+            {
+                vec.resize(size);
+            }
+    };
+    
+    /*
+    Sources give bytes to a bit reader. A source provides:
+    data(): pointer to the bytes already available
+    available(): number of bytes at data()
+    skip(bytes): marks that many available bytes as taken
+    take(dst, bytes): copies up to bytes bytes out at once, returning how many there were
+    fetch(): makes more bytes available once none are left, returns false at the end of input
+    BitReader works with any class providing these, not only the sources below
+    */
+    
+    /*
+    Source reading blocks from an istream
+    */
+    class StreamSource {
+        private:
+            std::istream& stream;
+            size_t index;
+            size_t end;
+            std::vector<std::uint8_t> block;
         public:
             /*
-            stream: The ostream this BitBufferOut wraps
-            order: The bit order, defaults to MSB first
+            stream: Source of the bytes
+            blockSize: Number of bytes to read at a time.
+                0 reads single bytes only as they are needed
             */
-            BitBufferOut(std::ostream& stream, BitOrder order = MSB) : 
+            StreamSource(std::istream& stream, size_t blockSize) :
                 stream{stream},
                 index{0},
-                building{0},
-                order{order} {}
+                end{0},
+                block(blockSize ? blockSize : 1) {}
+            
+            inline const std::uint8_t* data() const
+            {
+                return block.data() + index;
+            }
+            
+            inline size_t available() const
+            {
+                return end - index;
+            }
+            
+            inline void skip(size_t bytes)
+            {
+                index += bytes;
+            }
+            
+            size_t take(std::uint8_t *dst, size_t bytes);
+            
+            bool fetch();
+    };
+    
+    /*
+    Source reading straight from caller-provided memory
+    */
+    class SpanSource {
+        private:
+            const std::uint8_t *begin;
+            size_t size;
+            size_t index;
+        public:
+            SpanSource(const std::uint8_t *data, size_t size) :
+                begin{data},
+                size{size},
+                index{0} {}
+            
+            inline const std::uint8_t* data() const
+            {
+                return begin + index;
+            }
+            
+            inline size_t available() const
+            {
+                return size - index;
+            }
+            
+            inline void skip(size_t bytes)
+            {
+                index += bytes;
+            }
+            
+            inline size_t take(std::uint8_t *dst, size_t bytes)
+            {
+                bytes = std::min(bytes, size - index);
+                std::memcpy(dst, begin + index, bytes);
+                index += bytes;
+                return bytes;
+            }
+            
+            inline bool fetch()
+            {
+                return false;
+            }
+    };
+    
+    /*
+    Performs bitwise writes in a bit order fixed at compile time, handing completed bytes to a sink
+    */
+    template <class Sink, BitOrder Order>
+    class BitWriter {
+        private:
+            std::uint64_t accumulator;
+            size_t bitCount;
+            Sink sink;
+            void stage(size_t bits);
+            
+            /*
+            Append bits in stream order: MSB first shifts them in at the low end of the accumulator,
+            LSB first puts them above the bits already there
+            */
+            inline size_t push(std::uint32_t value, size_t bits)
+            {
+                size_t written = ((bitCount & 7) + bits) >> 3;
+                std::uint64_t masked = value & ((std::uint64_t{1} << bits) - 1);
+                if (Order == MSB) {
+                    accumulator = (accumulator << bits) | masked;
+                }
+                else {
+                    accumulator |= masked << bitCount;
+                }
+                bitCount += bits;
+                if (sink.eager()) {
+                    if (written) {
+                        stage(bitCount & ~size_t{7});
+                    }
+                }
+                else if (bitCount >= 32) {
+                    stage(32);
+                }
+                return written;
+            }
+            
+            void merge(std::uint64_t word);
+            
+            /*
+            Append a run of 0-bits of any length
+            */
+            inline size_t zeros(size_t count)
+            {
+                size_t written = 0;
+                for (; count >= 32; count -= 32) {
+                    written += push(0, 32);
+                }
+                return written + push(0, count);
+            }
+            
+            /* Disallow copying */
+            BitWriter(const BitWriter& other);
+            
+        public:
+            /*
+            sink: Destination of completed bytes
+            */
+            BitWriter(Sink sink) :
+                accumulator{0},
+                bitCount{0},
+                sink{std::move(sink)} {}
             
             /*
             Flushes any remaining bits before destructing
             */
-            ~BitBufferOut();
+            ~BitWriter();
+            
+            /*
+            returns the sink completed bytes are handed to
+            */
+            inline const Sink& getSink() const
+            {
+                return sink;
+            }
+            
+            /*
+            returns the bit order
+            */
+            static constexpr BitOrder bitOrder()
+            {
+                return Order;
+            }
             
             /*
             Discard any buffered bits not yet written
             */
-            void reset();
+            inline void reset()
+            {
+                if (Order == MSB) {
+                    accumulator >>= bitCount & 7;
+                    bitCount &= ~size_t{7};
+                }
+                else {
+                    bitCount &= ~size_t{7};
+                    accumulator &= (std::uint64_t{1} << bitCount) - 1;
+                }
+            }
             
             /*
             Write an integer, in a specified number of bits, to the buffer
@@ -72,9 +477,66 @@ namespace BitBuffer {
             value: The integer to be written
             bits: The number of bits. The low bits of value are written
             
-            returns the number of bytes actually written to the underlying stream
+            returns the number of bytes completed by this write
+            */
+            inline size_t write(std::uint32_t value, size_t bits)
+            {
+                if (bits > 32) {
+                    throw BitBufferException("bit count too high");
+                }
+                if (Order == LSB) {
+                    value = reverseBits(value, bits);
+                }
+                return push(value, bits);
+            }
+            
+            /*
+            Write bits in the stream's own order, which for LSB first puts the low bit of value first.
+            This is how LSB formats like DEFLATE define most fields, and skips the reversal write does
+            
+            value: The bits to be written
+            bits: The number of bits, up to 32
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t writeNative(std::uint32_t value, size_t bits)
+            {
+                if (bits > 32) {
+                    throw BitBufferException("bit count too high");
+                }
+                return push(value, bits);
+            }
+            
+            /*
+            Write an integer of up to 64 bits, the first bit being the most significant as with write
+            
+            value: The integer to be written
+            bits: The number of bits. The low bits of value are written
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t write64(std::uint64_t value, size_t bits)
+            {
+                if (bits > 64) {
+                    throw BitBufferException("bit count too high");
+                }
+                if (bits <= 32) {
+                    return write(static_cast<std::uint32_t>(value), bits);
+                }
+                size_t written = write(static_cast<std::uint32_t>(value >> 32), bits - 32);
+                return written + write(static_cast<std::uint32_t>(value), 32);
+            }
+            
+            /*
+            Write a run of bits held in an array of words, in the stream's own order:
+            MSB first takes each word from bit 63 down, LSB first takes each from bit 0 up
+            
+            words: The bits to write
+            nbits: Number of bits to write. A partial last word supplies its first bits in that order
+            
+            returns the number of bytes completed by this write
             */
-            size_t write(std::uint32_t value, size_t bits);
+            size_t writeBits(const std::uint64_t *words, size_t nbits);
             
             /*
             Write a sequence of bytes from a point in memory
@@ -82,7 +544,7 @@ namespace BitBuffer {
             mem: Memory address to start writing from
             bytes: Number of bytes to write
             
-            returns the number of bytes actually written to the underlying stream
+            returns the number of bytes completed by this write
             */
             size_t writeData(const unsigned char *mem, size_t bytes);
             
@@ -94,279 +556,2072 @@ namespace BitBuffer {
             size_t writeUtf8(std::uint32_t value);
             
             /*
-            Flushes anything left in the buffer
+            Write an Elias gamma code: one less 0-bit than value has significant bits, then value
+            
+            value: Integer to write, at least 1
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t writeGamma(std::uint32_t value);
+            
+            /*
+            Write an Elias delta code: the gamma code of the number of significant bits in value,
+            then value below its top bit
+            
+            value: Integer to write, at least 1
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t writeDelta(std::uint32_t value);
+            
+            /*
+            Write a Golomb-Rice code: value >> k in unary as that many 0-bits and a 1-bit, then the low k bits
+            
+            value: Integer to write
+            k: Rice parameter, less than 32
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t writeRice(std::uint32_t value, size_t k);
+            
+            /*
+            Write an exponential Golomb code of order k: the gamma code of (value >> k) + 1, then the low k bits
+            
+            value: Integer to write
+            k: Order, less than 32
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t writeExpGolomb(std::uint32_t value, size_t k);
+            
+            /*
+            Write each of an array of integers with the matching single value code
+            
+            values: Integers to write
+            n: Number of integers
+            k: Parameter of the code
+            
+            returns the number of bytes completed by these writes
+            */
+            size_t writeGamma(const std::uint32_t *values, size_t n);
+            size_t writeDelta(const std::uint32_t *values, size_t n);
+            size_t writeRice(const std::uint32_t *values, size_t n, size_t k);
+            size_t writeExpGolomb(const std::uint32_t *values, size_t n, size_t k);
+            
+            /*
+            Pads any partial byte, then hands everything still buffered to the sink
             
             fill: If true, empty space is filled with 1-bits instead of 0-bits
             
-            returns the number of bytes actually written to the underlying stream
+            returns 1 if a partial byte was padded and written, otherwise 0
             */
             size_t flush(bool fill = false);
             
             template <class T>
-            inline BitBufferOut& operator<<(std::vector<T> vec)
+            inline BitWriter& operator<<(std::vector<T> vec)
             {
                 writeData(reinterpret_cast<const unsigned char*>(vec.data()), vec.size() * sizeof(T));
                 return *this;
             }
             
             template <class T>
-            inline BitBufferOut& operator<<(T value)
+            inline BitWriter& operator<<(T value)
             {
-                write(value, sizeof(T) * 8);
+                write64(value, sizeof(T) * 8);
                 return *this;
             }
     };
     
-    class BitBufferIn {
+    /*
+    Performs bitwise writes in a bit order chosen at runtime, handing completed bytes to a sink.
+    Each call is passed on to the BitWriter for that order
+    */
+    template <class Sink>
+    class BasicBitBufferOut {
         private:
-            std::istream& stream;
-            BITBUFFER_T building;
-            int index;
             BitOrder order;
-            void fetch();
+            union {
+                BitWriter<Sink, MSB> msb;
+                BitWriter<Sink, LSB> lsb;
+            };
             
             /* Disallow copying */
-            BitBufferIn(const BitBufferIn& other);
+            BasicBitBufferOut(const BasicBitBufferOut& other);
+            
         public:
             /*
-            stream: Source of bits
-            order: Bit order, MSB by default
+            sink: Destination of completed bytes
+            order: The bit order, defaults to MSB first
             */
-            BitBufferIn(std::istream& stream, BitOrder order = MSB) :
-                stream {stream},
-                order {order},
-                index {8},
-                building {0} {}
+            BasicBitBufferOut(Sink sink, BitOrder order = MSB) : order{order}
+            {
+                if (order == MSB) {
+                    new (&msb) BitWriter<Sink, MSB>(std::move(sink));
+                }
+                else {
+                    new (&lsb) BitWriter<Sink, LSB>(std::move(sink));
+                }
+            }
             
             /*
-            bits: Number of bits to read
-            returns up to the 32-bit representation of read bits
+            Flushes any remaining bits before destructing
             */
-            std::uint32_t read(size_t bits);
+            ~BasicBitBufferOut()
+            {
+                if (order == MSB) {
+                    msb.~BitWriter();
+                }
+                else {
+                    lsb.~BitWriter();
+                }
+            }
             
             /*
-            mem: Memory to write read data to
-            bytes: Number of bytes to read
+            returns the sink completed bytes are handed to
             */
-            size_t read(unsigned char *mem, size_t bytes);
+            inline const Sink& getSink() const
+            {
+                return order == MSB ? msb.getSink() : lsb.getSink();
+            }
             
             /*
-            Reads and returns the following UTF-8 value or throws BitBufferException
+            returns the bit order
             */
-            std::uint32_t readUtf8();
-    };
-    
-    /* Thrown when invalid arguments or state arise for bit ops */
-    class BitBufferException : public std::exception {
+            inline BitOrder bitOrder() const
+            {
+                return order;
+            }
+            
+            /*
+            Discard any buffered bits not yet written
+            */
+            inline void reset()
+            {
+                order == MSB ? msb.reset() : lsb.reset();
+            }
+            
+            /*
+            Write an integer, in a specified number of bits, to the buffer
+            
+            value: The integer to be written
+            bits: The number of bits. The low bits of value are written
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t write(std::uint32_t value, size_t bits)
+            {
+                return order == MSB ? msb.write(value, bits) : lsb.write(value, bits);
+            }
+            
+            /*
+            Write bits in the stream's own order, which for LSB first puts the low bit of value first
+            
+            value: The bits to be written
+            bits: The number of bits, up to 32
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t writeNative(std::uint32_t value, size_t bits)
+            {
+                return order == MSB ? msb.writeNative(value, bits) : lsb.writeNative(value, bits);
+            }
+            
+            /*
+            Write an integer of up to 64 bits, the first bit being the most significant as with write
+            
+            value: The integer to be written
+            bits: The number of bits. The low bits of value are written
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t write64(std::uint64_t value, size_t bits)
+            {
+                return order == MSB ? msb.write64(value, bits) : lsb.write64(value, bits);
+            }
+            
+            /*
+            Write a run of bits held in an array of words, in the stream's own order:
+            MSB first takes each word from bit 63 down, LSB first takes each from bit 0 up
+            
+            words: The bits to write
+            nbits: Number of bits to write. A partial last word supplies its first bits in that order
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t writeBits(const std::uint64_t *words, size_t nbits)
+            {
+                return order == MSB ? msb.writeBits(words, nbits) : lsb.writeBits(words, nbits);
+            }
+            
+            /*
+            Write a sequence of bytes from a point in memory
+            
+            mem: Memory address to start writing from
+            bytes: Number of bytes to write
+            
+            returns the number of bytes completed by this write
+            */
+            inline size_t writeData(const unsigned char *mem, size_t bytes)
+            {
+                return order == MSB ? msb.writeData(mem, bytes) : lsb.writeData(mem, bytes);
+            }
+            
+            /*
+            Write encoded UTF-8
+            
+            returns the number of bytes written
+            */
+            inline size_t writeUtf8(std::uint32_t value)
+            {
+                return order == MSB ? msb.writeUtf8(value) : lsb.writeUtf8(value);
+            }
+            
+            /*
+            Write an Elias gamma code, see BitWriter::writeGamma
+            */
+            inline size_t writeGamma(std::uint32_t value)
+            {
+                return order == MSB ? msb.writeGamma(value) : lsb.writeGamma(value);
+            }
+            
+            /*
+            Write an Elias delta code, see BitWriter::writeDelta
+            */
+            inline size_t writeDelta(std::uint32_t value)
+            {
+                return order == MSB ? msb.writeDelta(value) : lsb.writeDelta(value);
+            }
+            
+            /*
+            Write a Golomb-Rice code with parameter k, see BitWriter::writeRice
+            */
+            inline size_t writeRice(std::uint32_t value, size_t k)
+            {
+                return order == MSB ? msb.writeRice(value, k) : lsb.writeRice(value, k);
+            }
+            
+            /*
+            Write an exponential Golomb code of order k, see BitWriter::writeExpGolomb
+            */
+            inline size_t writeExpGolomb(std::uint32_t value, size_t k)
+            {
+                return order == MSB ? msb.writeExpGolomb(value, k) : lsb.writeExpGolomb(value, k);
+            }
+            
+            /*
+            Write each of an array of integers with the matching single value code
+            
+            values: Integers to write
+            n: Number of integers
+            k: Parameter of the code
+            
+            returns the number of bytes completed by these writes
+            */
+            inline size_t writeGamma(const std::uint32_t *values, size_t n)
+            {
+                return order == MSB ? msb.writeGamma(values, n) : lsb.writeGamma(values, n);
+            }
+            
+            inline size_t writeDelta(const std::uint32_t *values, size_t n)
+            {
+                return order == MSB ? msb.writeDelta(values, n) : lsb.writeDelta(values, n);
+            }
+            
+            inline size_t writeRice(const std::uint32_t *values, size_t n, size_t k)
+            {
+                return order == MSB ? msb.writeRice(values, n, k) : lsb.writeRice(values, n, k);
+            }
+            
+            inline size_t writeExpGolomb(const std::uint32_t *values, size_t n, size_t k)
+            {
+                return order == MSB ? msb.writeExpGolomb(values, n, k) : lsb.writeExpGolomb(values, n, k);
+            }
+            
+            /*
+            Pads any partial byte, then hands everything still buffered to the sink
+            
+            fill: If true, empty space is filled with 1-bits instead of 0-bits
+            
+            returns 1 if a partial byte was padded and written, otherwise 0
+            */
+            inline size_t flush(bool fill = false)
+            {
+                return order == MSB ? msb.flush(fill) : lsb.flush(fill);
+            }
+            
+            template <class T>
+            inline BasicBitBufferOut& operator<<(std::vector<T> vec)
+            {
+                writeData(reinterpret_cast<const unsigned char*>(vec.data()), vec.size() * sizeof(T));
+                return *this;
+            }
+            
+            template <class T>
+            inline BasicBitBufferOut& operator<<(T value)
+            {
+                write64(value, sizeof(T) * 8);
+                return *this;
+            }
+    };
+    
+    /*
+    A wrapper around an ostream that can perform bitwise writes
+    */
+    class BitBufferOut : public BasicBitBufferOut<StreamSink> {
+        public:
+            /*
+            stream: The ostream this BitBufferOut wraps
+            order: The bit order, defaults to MSB first
+            blockSize: Number of completed bytes to gather before handing them to stream.
+                0, the default, hands over and flushes every completed byte immediately
+            */
+            BitBufferOut(std::ostream& stream, BitOrder order = MSB, size_t blockSize = 0) :
+                BasicBitBufferOut<StreamSink>(StreamSink(stream, blockSize), order) {}
+    };
+    
+    /*
+    Performs bitwise writes into a caller-provided span of memory, throwing BitBufferException when it is full
+    */
+    class BitSpanOut : public BasicBitBufferOut<SpanSink> {
+        public:
+            /*
+            data: Start of the span
+            capacity: Size of the span in bytes
+            order: The bit order, defaults to MSB first
+            */
+            BitSpanOut(std::uint8_t *data, size_t capacity, BitOrder order = MSB) :
+                BasicBitBufferOut<SpanSink>(SpanSink(data, capacity), order) {}
+            
+            /*
+            returns the number of bytes in the span so far, only counting every bit written once flushed
+            */
+            inline size_t size() const
+            {
+                return getSink().written();
+            }
+    };
+    
+    /*
+    Performs bitwise writes appended to a vector
+    */
+    class BitVectorOut : public BasicBitBufferOut<VectorSink> {
+        public:
+            /*
+            vec: Vector to append to. It holds exactly the bytes written after each flush
+            order: The bit order, defaults to MSB first
+            */
+            BitVectorOut(std::vector<std::uint8_t>& vec, BitOrder order = MSB) :
+                BasicBitBufferOut<VectorSink>(VectorSink(vec), order) {}
+    };
+    
+    /*
+    Performs bitwise reads in a bit order fixed at compile time, taking bytes from a source
+    */
+    template <class Source, BitOrder Order>
+    class BitReader {
+        private:
+            std::uint64_t window;
+            size_t bitCount;
+            bool exhausted;
+            Source source;
+            void refill(size_t bits);
+            inline size_t unary(size_t limit);
+            
+            /* Disallow copying */
+            BitReader(const BitReader& other);
+            
+        public:
+            /*
+            source: Source of bytes
+            */
+            BitReader(Source source) :
+                window {0},
+                bitCount {0},
+                exhausted {false},
+                source {std::move(source)} {}
+            
+            /*
+            returns the bit order
+            */
+            static constexpr BitOrder bitOrder()
+            {
+                return Order;
+            }
+            
+            /*
+            Look at upcoming bits in the stream's own order without consuming them.
+            For MSB first that is the same as peek, for LSB first the first bit is the least significant.
+            Past the end of the input, 0-bits are read
+            
+            bits: Number of bits to look at, up to 32
+            returns the next bits
+            */
+            inline std::uint32_t peekNative(size_t bits)
+            {
+                if (bitCount < bits) {
+                    refill(bits);
+                }
+                if (Order == MSB) {
+                    return (window >> 1) >> (63 - bits);
+                }
+                return window & ((std::uint64_t{1} << bits) - 1);
+            }
+            
+            /*
+            Look at upcoming bits without consuming them. Past the end of the input, 0-bits are read
+            
+            bits: Number of bits to look at, up to 32
+            returns the next bits, the first of them in the most significant position
+            */
+            inline std::uint32_t peek(size_t bits)
+            {
+                std::uint32_t val = peekNative(bits);
+                if (Order == LSB) {
+                    val = reverseBits(val, bits);
+                }
+                return val;
+            }
+            
+            /*
+            Skip over bits that have already been looked at with peek
+            
+            bits: Number of bits, no more than the last peek
+            */
+            inline void consume(size_t bits)
+            {
+                if (Order == MSB) {
+                    window <<= bits;
+                }
+                else {
+                    window >>= bits;
+                }
+                bitCount -= bits;
+            }
+            
+            /*
+            bits: Number of bits to read
+            returns up to the 32-bit representation of read bits
+            */
+            inline std::uint32_t read(size_t bits)
+            {
+                if (bits > 32) {
+                    throw BitBufferException("bit count too high");
+                }
+                std::uint32_t val = peek(bits);
+                consume(bits);
+                return val;
+            }
+            
+            /*
+            bits: Number of bits to read
+            returns up to 32 bits in the stream's own order, as with peekNative
+            */
+            inline std::uint32_t readNative(size_t bits)
+            {
+                if (bits > 32) {
+                    throw BitBufferException("bit count too high");
+                }
+                std::uint32_t val = peekNative(bits);
+                consume(bits);
+                return val;
+            }
+            
+            /*
+            bits: Number of bits to read, up to 64
+            returns the read bits, the first of them in the most significant position
+            */
+            inline std::uint64_t read64(size_t bits)
+            {
+                if (bits > 64) {
+                    throw BitBufferException("bit count too high");
+                }
+                if (bits <= 32) {
+                    return read(bits);
+                }
+                std::uint64_t high = read(bits - 32);
+                return (high << 32) | read(32);
+            }
+            
+            /*
+            Read a run of bits into an array of words, in the stream's own order as with BitWriter::writeBits
+            
+            words: Destination of the bits
+            nbits: Number of bits to read. The rest of a partial last word is set to 0
+            
+            returns nbits
+            */
+            size_t readBits(std::uint64_t *words, size_t nbits);
+            
+            /*
+            mem: Memory to write read data to
+            bytes: Number of bytes to read
+            */
+            size_t read(unsigned char *mem, size_t bytes);
+            
+            /*
+            Reads and returns the following UTF-8 value or throws BitBufferException
+            */
+            std::uint32_t readUtf8();
+            
+            /*
+            Read an Elias gamma code, throwing BitBufferException if it is longer than any 32-bit value's
+            or its 1-bit does not come before the end of the input
+            */
+            inline std::uint32_t readGamma();
+            
+            /*
+            Read an Elias delta code, throwing BitBufferException if it is longer than any 32-bit value's
+            or its 1-bit does not come before the end of the input
+            */
+            inline std::uint32_t readDelta();
+            
+            /*
+            Read a Golomb-Rice code, throwing BitBufferException if it is longer than any 32-bit value's
+            or its 1-bit does not come before the end of the input
+            
+            k: Rice parameter, less than 32
+            */
+            inline std::uint32_t readRice(size_t k);
+            
+            /*
+            Read an exponential Golomb code, throwing BitBufferException if it is longer than any 32-bit value's
+            or its 1-bit does not come before the end of the input
+            
+            k: Order, less than 32
+            */
+            inline std::uint32_t readExpGolomb(size_t k);
+            
+            /*
+            Read an array of integers, each with the matching single value code
+            
+            values: Destination of the integers
+            n: Number of integers
+            k: Parameter of the code
+            */
+            void readGamma(std::uint32_t *values, size_t n);
+            void readDelta(std::uint32_t *values, size_t n);
+            void readRice(std::uint32_t *values, size_t n, size_t k);
+            void readExpGolomb(std::uint32_t *values, size_t n, size_t k);
+    };
+    
+    /*
+    Performs bitwise reads in a bit order chosen at runtime, taking bytes from a source.
+    Each call is passed on to the BitReader for that order
+    */
+    template <class Source>
+    class BasicBitBufferIn {
+        private:
+            BitOrder order;
+            union {
+                BitReader<Source, MSB> msb;
+                BitReader<Source, LSB> lsb;
+            };
+            
+            /* Disallow copying */
+            BasicBitBufferIn(const BasicBitBufferIn& other);
+            
+        public:
+            /*
+            source: Source of bytes
+            order: Bit order, MSB by default
+            */
+            BasicBitBufferIn(Source source, BitOrder order = MSB) : order{order}
+            {
+                if (order == MSB) {
+                    new (&msb) BitReader<Source, MSB>(std::move(source));
+                }
+                else {
+                    new (&lsb) BitReader<Source, LSB>(std::move(source));
+                }
+            }
+            
+            ~BasicBitBufferIn()
+            {
+                if (order == MSB) {
+                    msb.~BitReader();
+                }
+                else {
+                    lsb.~BitReader();
+                }
+            }
+            
+            /*
+            returns the bit order
+            */
+            inline BitOrder bitOrder() const
+            {
+                return order;
+            }
+            
+            /*
+            Look at upcoming bits in the stream's own order without consuming them.
+            For MSB first that is the same as peek, for LSB first the first bit is the least significant
+            
+            bits: Number of bits to look at, up to 32
+            returns the next bits
+            */
+            inline std::uint32_t peekNative(size_t bits)
+            {
+                return order == MSB ? msb.peekNative(bits) : lsb.peekNative(bits);
+            }
+            
+            /*
+            Look at upcoming bits without consuming them. Past the end of the input, 0-bits are read
+            
+            bits: Number of bits to look at, up to 32
+            returns the next bits, the first of them in the most significant position
+            */
+            inline std::uint32_t peek(size_t bits)
+            {
+                return order == MSB ? msb.peek(bits) : lsb.peek(bits);
+            }
+            
+            /*
+            Skip over bits that have already been looked at with peek
+            
+            bits: Number of bits, no more than the last peek
+            */
+            inline void consume(size_t bits)
+            {
+                order == MSB ? msb.consume(bits) : lsb.consume(bits);
+            }
+            
+            /*
+            bits: Number of bits to read
+            returns up to the 32-bit representation of read bits
+            */
+            inline std::uint32_t read(size_t bits)
+            {
+                return order == MSB ? msb.read(bits) : lsb.read(bits);
+            }
+            
+            /*
+            bits: Number of bits to read
+            returns up to 32 bits in the stream's own order, as with peekNative
+            */
+            inline std::uint32_t readNative(size_t bits)
+            {
+                return order == MSB ? msb.readNative(bits) : lsb.readNative(bits);
+            }
+            
+            /*
+            bits: Number of bits to read, up to 64
+            returns the read bits, the first of them in the most significant position
+            */
+            inline std::uint64_t read64(size_t bits)
+            {
+                return order == MSB ? msb.read64(bits) : lsb.read64(bits);
+            }
+            
+            /*
+            Read a run of bits into an array of words, in the stream's own order as with BitWriter::writeBits
+            
+            words: Destination of the bits
+            nbits: Number of bits to read. The rest of a partial last word is set to 0
+            
+            returns nbits
+            */
+            inline size_t readBits(std::uint64_t *words, size_t nbits)
+            {
+                return order == MSB ? msb.readBits(words, nbits) : lsb.readBits(words, nbits);
+            }
+            
+            /*
+            mem: Memory to write read data to
+            bytes: Number of bytes to read
+            */
+            inline size_t read(unsigned char *mem, size_t bytes)
+            {
+                return order == MSB ? msb.read(mem, bytes) : lsb.read(mem, bytes);
+            }
+            
+            /*
+            Reads and returns the following UTF-8 value or throws BitBufferException
+            */
+            inline std::uint32_t readUtf8()
+            {
+                return order == MSB ? msb.readUtf8() : lsb.readUtf8();
+            }
+            
+            /*
+            Read an Elias gamma code, see BitReader::readGamma
+            */
+            inline std::uint32_t readGamma()
+            {
+                return order == MSB ? msb.readGamma() : lsb.readGamma();
+            }
+            
+            /*
+            Read an Elias delta code, see BitReader::readDelta
+            */
+            inline std::uint32_t readDelta()
+            {
+                return order == MSB ? msb.readDelta() : lsb.readDelta();
+            }
+            
+            /*
+            Read a Golomb-Rice code with parameter k, see BitReader::readRice
+            */
+            inline std::uint32_t readRice(size_t k)
+            {
+                return order == MSB ? msb.readRice(k) : lsb.readRice(k);
+            }
+            
+            /*
+            Read an exponential Golomb code of order k, see BitReader::readExpGolomb
+            */
+            inline std::uint32_t readExpGolomb(size_t k)
+            {
+                return order == MSB ? msb.readExpGolomb(k) : lsb.readExpGolomb(k);
+            }
+            
+            /*
+            Read an array of integers, each with the matching single value code
+            
+            values: Destination of the integers
+            n: Number of integers
+            k: Parameter of the code
+            */
+            inline void readGamma(std::uint32_t *values, size_t n)
+            {
+                order == MSB ? msb.readGamma(values, n) : lsb.readGamma(values, n);
+            }
+            
+            inline void readDelta(std::uint32_t *values, size_t n)
+            {
+                order == MSB ? msb.readDelta(values, n) : lsb.readDelta(values, n);
+            }
+            
+            inline void readRice(std::uint32_t *values, size_t n, size_t k)
+            {
+                order == MSB ? msb.readRice(values, n, k) : lsb.readRice(values, n, k);
+            }
+            
+            inline void readExpGolomb(std::uint32_t *values, size_t n, size_t k)
+            {
+                order == MSB ? msb.readExpGolomb(values, n, k) : lsb.readExpGolomb(values, n, k);
+            }
+    };
+    
+    /*
+    A wrapper around an istream that can perform bitwise reads
+    */
+    class BitBufferIn : public BasicBitBufferIn<StreamSource> {
+        public:
+            /*
+            stream: Source of bits
+            order: Bit order, MSB by default
+            blockSize: Number of bytes to read from stream at a time.
+                0, the default, reads single bytes only as they are needed
+            */
+            BitBufferIn(std::istream& stream, BitOrder order = MSB, size_t blockSize = 0) :
+                BasicBitBufferIn<StreamSource>(StreamSource(stream, blockSize), order) {}
+    };
+    
+    /*
+    Performs bitwise reads straight from caller-provided memory
+    */
+    class BitSpanIn : public BasicBitBufferIn<SpanSource> {
+        public:
+            /*
+            data: Start of the bytes to read
+            size: Number of bytes
+            order: Bit order, MSB by default
+            */
+            BitSpanIn(const std::uint8_t *data, size_t size, BitOrder order = MSB) :
+                BasicBitBufferIn<SpanSource>(SpanSource(data, size), order) {}
+    };
+    
+}
+
+/*
+Bitwise analyses and manipulation functions
+*/
+namespace BitManip {
+    
+    /*
+    Count the number of 1-bits in a given number
+    
+    number: a 32-bit unsigned integer
+    
+    returns the number of bits set to 1 in number
+    */
+    inline size_t bitsSet(std::uint32_t number)
+    {
+#if defined(__GNUC__)
+        return __builtin_popcount(number);
+#else
+        number -= (number >> 1) & 0x55555555;
+        number = (number & 0x33333333) + ((number >> 2) & 0x33333333);
+        number = (number & 0x0F0F0F0F) + ((number >> 4) & 0x0F0F0F0F);
+        number = (number & 0x00FF00FF) + ((number >> 8) & 0x00FF00FF);
+        number = (number & 0x0000FFFF) + (number >> 16);
+        return number;
+#endif
+    }
+    
+    /*
+    Count the number of contiguous 0-bits starting at MSB
+    
+    number: a 32-bit unsigned integer
+    
+    returns the number of leading zeros
+    */
+    inline size_t leadingZeros(std::uint32_t number)
+    {
+#if defined(_MSC_VER)
+        long mask;
+        if (_BitScanReverse(&mask, number))
+            return sizeof(std::uint32_t) * 8 - 1 - mask;
+        return sizeof(std::uint32_t) * 8;
+#elif defined(__GNUC__)
+        if (number == 0)
+            return sizeof(std::uint32_t) * 8;
+        return __builtin_clz(number);
+#else
+        number |= number >> 16;
+        number |= number >> 8;
+        number |= number >> 4;
+        number |= number >> 2;
+        number |= number >> 1;
+        return sizeof(std::uint32_t) * 8 - bitsSet(number);
+#endif
+    }
+    
+    /*
+    Count the number of contiguous 0-bits ending with LSB
+    
+    number: a 32-bit unsigned integer
+    
+    returns the number of trailing zeros
+    */
+    inline size_t trailingZeros(std::uint32_t number)
+    {
+#if defined(_MSC_VER)
+        long mask;
+        if (_BitScanForward(&mask, number))
+            return mask;
+        return sizeof(std::uint32_t) * 8;
+#elif defined(__GNUC__)
+        if (number == 0)
+            return sizeof(std::uint32_t) * 8;
+        return __builtin_ctz(number);
+#else
+        number |= number << 16;
+        number |= number << 8;
+        number |= number << 4;
+        number |= number << 2;
+        number |= number << 1;
+        return sizeof(std::uint32_t) * 8 - bitsSet(number);
+#endif
+    }
+    
+    /*
+    Find the position of the most significant 1-bit
+    
+    number: a 32-bit unsigned integer
+    
+    returns the 0-index position of the set MSB, or 32 for 0
+    */
+    inline size_t msbSet(std::uint32_t number)
+    {
+#if defined(_MSC_VER)
+        long mask;
+        if (_BitScanReverse(&mask, number))
+            return mask;
+        return sizeof(std::uint32_t) * 8;
+#elif defined(__GNUC__)
+        if (number == 0)
+            return sizeof(std::uint32_t) * 8;
+        return sizeof(std::uint32_t) * 8 - 1 - __builtin_clz(number);
+#else
+        if (number == 0)
+            return sizeof(std::uint32_t) * 8;
+        number |= number >> 16;
+        number |= number >> 8;
+        number |= number >> 4;
+        number |= number >> 2;
+        number |= number >> 1;
+        return bitsSet(number) - 1;
+#endif
+    }
+    
+    /*
+    Find the position of the least significant 1-bit
+    
+    number: a 32-bit unsigned integer
+    
+    returns the 0-index position of the set LSB, or 32 for 0
+    */
+    inline size_t lsbSet(std::uint32_t number)
+    {
+#if defined(_MSC_VER)
+        long mask;
+        if (_BitScanForward(&mask, number))
+            return mask;
+        return sizeof(std::uint32_t) * 8;
+#elif defined(__GNUC__)
+        if (number == 0)
+            return sizeof(std::uint32_t) * 8;
+        return __builtin_ctz(number);
+#else
+        if (number == 0)
+            return sizeof(std::uint32_t) * 8;
+        number |= number << 16;
+        number |= number << 8;
+        number |= number << 4;
+        number |= number << 2;
+        number |= number << 1;
+        return sizeof(std::uint32_t) * 8 - bitsSet(number);
+#endif
+    }
+    
+    /*
+    Count the number of 1-bits in a given number
+    
+    number: a 64-bit unsigned integer
+    
+    returns the number of bits set to 1 in number
+    */
+    inline size_t bitsSet64(std::uint64_t number)
+    {
+#if defined(__GNUC__)
+        return __builtin_popcountll(number);
+#else
+        number -= (number >> 1) & 0x5555555555555555;
+        number = (number & 0x3333333333333333) + ((number >> 2) & 0x3333333333333333);
+        number = (number + (number >> 4)) & 0x0F0F0F0F0F0F0F0F;
+        return (number * 0x0101010101010101) >> 56;
+#endif
+    }
+    
+    /*
+    Count the number of contiguous 0-bits starting at MSB
+    
+    number: a 64-bit unsigned integer
+    
+    returns the number of leading zeros
+    */
+    inline size_t leadingZeros64(std::uint64_t number)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        unsigned long mask;
+        if (_BitScanReverse64(&mask, number))
+            return sizeof(std::uint64_t) * 8 - 1 - mask;
+        return sizeof(std::uint64_t) * 8;
+#elif defined(__GNUC__)
+        if (number == 0)
+            return sizeof(std::uint64_t) * 8;
+        return __builtin_clzll(number);
+#else
+        std::uint32_t high = number >> 32;
+        if (high != 0)
+            return leadingZeros(high);
+        return 32 + leadingZeros((std::uint32_t)number);
+#endif
+    }
+    
+    /*
+    Count the number of contiguous 0-bits ending with LSB
+    
+    number: a 64-bit unsigned integer
+    
+    returns the number of trailing zeros
+    */
+    inline size_t trailingZeros64(std::uint64_t number)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        unsigned long mask;
+        if (_BitScanForward64(&mask, number))
+            return mask;
+        return sizeof(std::uint64_t) * 8;
+#elif defined(__GNUC__)
+        if (number == 0)
+            return sizeof(std::uint64_t) * 8;
+        return __builtin_ctzll(number);
+#else
+        std::uint32_t low = (std::uint32_t)number;
+        if (low != 0)
+            return trailingZeros(low);
+        return 32 + trailingZeros((std::uint32_t)(number >> 32));
+#endif
+    }
+    
+    /*
+    Find the position of the most significant 1-bit
+    
+    number: a 64-bit unsigned integer
+    
+    returns the 0-index position of the set MSB, or 64 for 0
+    */
+    inline size_t msbSet64(std::uint64_t number)
+    {
+        if (number == 0)
+            return sizeof(std::uint64_t) * 8;
+        return sizeof(std::uint64_t) * 8 - 1 - leadingZeros64(number);
+    }
+    
+    /*
+    Find the position of the least significant 1-bit
+    
+    number: a 64-bit unsigned integer
+    
+    returns the 0-index position of the set LSB, or 64 for 0
+    */
+    inline size_t lsbSet64(std::uint64_t number)
+    {
+        return trailingZeros64(number);
+    }
+    
+    /*
+    Compile-time versions of the functions above, for use in constant expressions.
+    They give the same results, but do not use intrinsics, so prefer the others at run time.
+    Each is a single return statement, as C++11 requires of constexpr functions
+    */
+    
+    /*
+    Steps of constBitsSet64: count the 1-bits of each pair of bits, then of each nibble, then of each byte
+    */
+    constexpr std::uint64_t constPairBitsSet(std::uint64_t number)
+    {
+        return number - ((number >> 1) & 0x5555555555555555);
+    }
+    
+    constexpr std::uint64_t constNibbleBitsSet(std::uint64_t pairs)
+    {
+        return (pairs & 0x3333333333333333) + ((pairs >> 2) & 0x3333333333333333);
+    }
+    
+    constexpr std::uint64_t constByteBitsSet(std::uint64_t nibbles)
+    {
+        return (nibbles + (nibbles >> 4)) & 0x0F0F0F0F0F0F0F0F;
+    }
+    
+    constexpr size_t constBitsSet64(std::uint64_t number)
+    {
+        return (constByteBitsSet(constNibbleBitsSet(constPairBitsSet(number))) * 0x0101010101010101) >> 56;
+    }
+    
+    constexpr size_t constBitsSet(std::uint32_t number)
+    {
+        return constBitsSet64(number);
+    }
+    
+    /*
+    Step of constLeadingZeros64: copy each 1-bit into every lower bit, shift bits and then half as many at a time
+    */
+    constexpr std::uint64_t constSmearRight(std::uint64_t number, size_t shift)
+    {
+        return shift == 0 ? number : constSmearRight(number | (number >> shift), shift / 2);
+    }
+    
+    constexpr size_t constLeadingZeros64(std::uint64_t number)
+    {
+        return sizeof(std::uint64_t) * 8 - constBitsSet64(constSmearRight(number, 32));
+    }
+    
+    constexpr size_t constLeadingZeros(std::uint32_t number)
+    {
+        return constLeadingZeros64(number) - 32;
+    }
+    
+    constexpr size_t constTrailingZeros64(std::uint64_t number)
+    {
+        return constBitsSet64(~number & (number - 1));
+    }
+    
+    constexpr size_t constTrailingZeros(std::uint32_t number)
+    {
+        return number == 0 ? sizeof(std::uint32_t) * 8 : constTrailingZeros64(number);
+    }
+    
+    constexpr size_t constMsbSet64(std::uint64_t number)
+    {
+        return number == 0 ? sizeof(std::uint64_t) * 8 : sizeof(std::uint64_t) * 8 - 1 - constLeadingZeros64(number);
+    }
+    
+    constexpr size_t constMsbSet(std::uint32_t number)
+    {
+        return number == 0 ? sizeof(std::uint32_t) * 8 : constMsbSet64(number);
+    }
+    
+    constexpr size_t constLsbSet64(std::uint64_t number)
+    {
+        return constTrailingZeros64(number);
+    }
+    
+    constexpr size_t constLsbSet(std::uint32_t number)
+    {
+        return constTrailingZeros(number);
+    }
+    
+    /*
+    Count the number of 1-bits in a buffer, such as a bitmap
+    
+    words: Words to count the bits of
+    n: Number of words
+    returns the total number of bits set to 1 in words
+    */
+    size_t popcount(const std::uint64_t *words, size_t n);
+    
+    /*
+    Reverse the order of bits in an 8-bit integer
+    
+    number: 8-bit unsigned integer to reverse
+    
+    returns the bitwise reversal of number
+    */
+    inline std::uint8_t reverse8(std::uint8_t number)
+    {
+#if defined(BITUTIL_BITREVERSE)
+        return __builtin_bitreverse8(number);
+#else
+        number = ((number & 0xF0) >> 4) | ((number & 0x0F) << 4);
+        number = ((number & 0xCC) >> 2) | ((number & 0x33) << 2);
+        number = ((number & 0xAA) >> 1) | ((number & 0x55) << 1);
+        return number;
+#endif
+    }
+    
+    /*
+    Reverse the order of bytes in a 16-bit integer
+    */
+    inline std::uint16_t byteswap16(std::uint16_t number)
+    {
+#if defined(_MSC_VER)
+        return _byteswap_ushort(number);
+#elif defined(__GNUC__)
+        return __builtin_bswap16(number);
+#else
+        return (number >> 8) | (number << 8);
+#endif
+    }
+    
+    /*
+    Reverse the order of bytes in a 32-bit integer
+    */
+    inline std::uint32_t byteswap32(std::uint32_t number)
+    {
+#if defined(_MSC_VER)
+        return _byteswap_ulong(number);
+#elif defined(__GNUC__)
+        return __builtin_bswap32(number);
+#else
+        number = (number >> 16) | (number << 16);
+        return ((number & 0xFF00FF00) >> 8) | ((number & 0x00FF00FF) << 8);
+#endif
+    }
+    
+    /*
+    Reverse the order of bytes in a 64-bit integer
+    */
+    inline std::uint64_t byteswap64(std::uint64_t number)
+    {
+#if defined(_MSC_VER)
+        return _byteswap_uint64(number);
+#elif defined(__GNUC__)
+        return __builtin_bswap64(number);
+#else
+        number = (number >> 32) | (number << 32);
+        number = ((number & 0xFFFF0000FFFF0000) >> 16) | ((number & 0x0000FFFF0000FFFF) << 16);
+        return ((number & 0xFF00FF00FF00FF00) >> 8) | ((number & 0x00FF00FF00FF00FF) << 8);
+#endif
+    }
+    
+    /*
+    Reverse the order of bits in a 16-bit integer
+    
+    number: 16-bit unsigned integer to reverse
+    
+    returns the bitwise reversal of number
+    */
+    inline std::uint16_t reverse16(std::uint16_t number)
+    {
+#if defined(BITUTIL_BITREVERSE)
+        return __builtin_bitreverse16(number);
+#else
+        number = byteswap16(number);
+        number = ((number & 0xF0F0) >> 4) | ((number & 0x0F0F) << 4);
+        number = ((number & 0xCCCC) >> 2) | ((number & 0x3333) << 2);
+        number = ((number & 0xAAAA) >> 1) | ((number & 0x5555) << 1);
+        return number;
+#endif
+    }
+    
+    /*
+    Reverse the order of bits in a 32-bit integer
+    
+    number: 32-bit unsigned integer to reverse
+    
+    returns the bitwise reversal of number
+    */
+    inline std::uint32_t reverse32(std::uint32_t number)
+    {
+#if defined(BITUTIL_BITREVERSE)
+        return __builtin_bitreverse32(number);
+#else
+        number = byteswap32(number);
+        number = ((number & 0xF0F0F0F0) >> 4) | ((number & 0x0F0F0F0F) << 4);
+        number = ((number & 0xCCCCCCCC) >> 2) | ((number & 0x33333333) << 2);
+        number = ((number & 0xAAAAAAAA) >> 1) | ((number & 0x55555555) << 1);
+        return number;
+#endif
+    }
+    
+    /*
+    Reverse the order of bits in a 64-bit integer
+    
+    number: 64-bit unsigned integer to reverse
+    
+    returns the bitwise reversal of number
+    */
+    inline std::uint64_t reverse64(std::uint64_t number)
+    {
+#if defined(BITUTIL_BITREVERSE)
+        return __builtin_bitreverse64(number);
+#else
+        number = byteswap64(number);
+        number = ((number & 0xF0F0F0F0F0F0F0F0) >> 4) | ((number & 0x0F0F0F0F0F0F0F0F) << 4);
+        number = ((number & 0xCCCCCCCCCCCCCCCC) >> 2) | ((number & 0x3333333333333333) << 2);
+        number = ((number & 0xAAAAAAAAAAAAAAAA) >> 1) | ((number & 0x5555555555555555) << 1);
+        return number;
+#endif
+    }
+    
+    /*
+    Reverse the order of bits within each byte of a buffer, converting bitmaps between LSB and MSB first
+    
+    data: Bytes to reverse in place
+    n: Number of bytes
+    */
+    void reverseBits(std::uint8_t *data, size_t n);
+    
+    /*
+    Reverse the order of bytes within each integer of a buffer, converting it between little and big endian
+    
+    data: Integers to swap in place
+    n: Number of integers
+    */
+    void byteswap(std::uint16_t *data, size_t n);
+    void byteswap(std::uint32_t *data, size_t n);
+    void byteswap(std::uint64_t *data, size_t n);
+    
+// #define UTF8_MAX_LEN 6
+    constexpr int UTF8_MAX_LEN = 6;
+    
+    /*
+    Convert an integer to the UTF-8 representation
+    
+    returns the number of bytes needed to represent v
+    */
+    size_t utf8(std::uint32_t v, std::uint8_t *dst);
+    
+    /*
+    Convert UTF-8 to a single integer
+    
+    returns the number of bytes used, 0 for failure
+    */
+    size_t utf8(const std::uint8_t *src, std::uint32_t &v);
+    
+    /*
+    Check a buffer of UTF-8, accepting every sequence that utf8 accepts
+    
+    src: UTF-8 to check
+    n: Number of bytes in src
+    returns the number of bytes at the start of src that form whole, valid sequences, n if src is valid
+    */
+    size_t utf8Validate(const std::uint8_t *src, size_t n);
+    
+    /*
+    Count the codepoints in a buffer of UTF-8
+    
+    returns the number of codepoints before the first invalid or cut off sequence
+    */
+    size_t utf8Count(const std::uint8_t *src, size_t n);
+    
+    /*
+    Decode a buffer of UTF-8 to UTF-32, stopping at the first invalid or cut off sequence
+    
+    src: UTF-8 to decode
+    n: Number of bytes in src
+    dst: Room for up to n codepoints
+    returns the number of codepoints written to dst
+    */
+    size_t utf8ToUtf32(const std::uint8_t *src, size_t n, std::uint32_t *dst);
+    
+    /*
+    Encode a buffer of UTF-32 as UTF-8
+    
+    src: Codepoints to encode
+    n: Number of codepoints in src
+    dst: Room for up to n * UTF8_MAX_LEN bytes
+    returns the number of bytes written to dst
+    */
+    size_t utf32ToUtf8(const std::uint32_t *src, size_t n, std::uint8_t *dst);
+    
+    /*
+    Pack integers that share one bit width, with the same layout as BitBufferOut::write(in[i], width)
+    for each value, starting on a byte boundary and padded with 0-bits to a whole byte
+    
+    in: Values to pack, only their low width bits are used
+    n: Number of values
+    width: Bits per value, up to 32
+    out: Room for (n * width + 7) / 8 bytes
+    order: Bit order of the layout
+    returns the number of bytes written to out
+    */
+    size_t pack(const std::uint32_t *in, size_t n, unsigned width, std::uint8_t *out, BitBuffer::BitOrder order = BitBuffer::MSB);
+    
+    /*
+    Unpack integers that share one bit width, reading the layout pack writes
+    
+    in: (n * width + 7) / 8 bytes of packed values
+    n: Number of values
+    width: Bits per value, up to 32
+    out: Room for n values
+    order: Bit order of the layout
+    returns the number of bytes read from in
+    */
+    size_t unpack(const std::uint8_t *in, size_t n, unsigned width, std::uint32_t *out, BitBuffer::BitOrder order = BitBuffer::MSB);
+    
+    /*
+    Given a first UTF-8 byte, how many more are there for this codepoint?
+    */
+    inline size_t utf8BytesLeft(std::uint8_t firstByte)
+    {
+        size_t firstZero = msbSet((std::uint8_t)~firstByte);
+        if (firstZero == 7) {
+            return 0;
+        }
+        return 6 - firstZero;
+    }
+    
+    /*
+    A read-only array of bits with constant time rank and fast select queries.
+    Counts are kept per 2048-bit block, taking about 3% on top of the bits themselves
+    */
+    class BitVector {
         private:
-            std::string message;
+            std::vector<std::uint64_t> words;
+            std::vector<std::uint64_t> upper;
+            std::vector<std::uint64_t> blocks;
+            std::vector<std::uint64_t> samples;
+            size_t length;
+            size_t ones;
+            void build();
+            size_t blockRank(size_t block) const;
         public:
-            BitBufferException(std::string message) : message{message} {};
-            virtual const char* what();
+            
+            /*
+            Construct from an array of words, bit i being bit i % 64 of words[i / 64]
+            
+            words: The bits
+            bits: Number of bits
+            */
+            BitVector(const std::uint64_t *words, size_t bits);
+            
+            /*
+            Construct from bytes laid out as a bit buffer writes them
+            
+            data: The bytes, as written by e.g. BitVectorOut
+            bits: Number of bits
+            order: Bit order data was written with
+            */
+            BitVector(const std::uint8_t *data, size_t bits, BitBuffer::BitOrder order = BitBuffer::MSB);
+            
+            /*
+            Construct from the next bits of a bit buffer or BitReader
+            
+            reader: Source of the bits
+            bits: Number of bits to read
+            */
+            template <class Reader>
+            BitVector(Reader& reader, size_t bits);
+            
+            /*
+            returns the number of bits
+            */
+            inline size_t size() const
+            {
+                return length;
+            }
+            
+            /*
+            returns the number of 1-bits
+            */
+            inline size_t count() const
+            {
+                return ones;
+            }
+            
+            /*
+            returns bit i
+            */
+            inline bool operator[](size_t i) const
+            {
+                return (words[i / 64] >> (i % 64)) & 1;
+            }
+            
+            /*
+            Count the 1-bits before a position
+            
+            i: Position, up to size()
+            returns the number of 1-bits in [0, i)
+            */
+            size_t rank1(size_t i) const;
+            
+            /*
+            Count the 0-bits before a position
+            
+            i: Position, up to size()
+            returns the number of 0-bits in [0, i)
+            */
+            inline size_t rank0(size_t i) const
+            {
+                return i - rank1(i);
+            }
+            
+            /*
+            Find a 1-bit by its rank
+            
+            k: 0-index rank of the 1-bit
+            returns the position of the 1-bit with k 1-bits before it, or size() if there are not that many
+            */
+            size_t select1(size_t k) const;
     };
     
+    template <class Reader>
+    BitVector::BitVector(Reader& reader, size_t bits) : words((bits + 63) / 64), length{bits}
+    {
+        reader.readBits(words.data(), bits);
+        // Stream order puts the first bit of an MSB first word at its top
+        if (reader.bitOrder() == BitBuffer::MSB) {
+            for (size_t i = 0; i < words.size(); i++) {
+                words[i] = reverse64(words[i]);
+            }
+        }
+        build();
+    }
+    
+}
+
+inline std::uint32_t BitBuffer::reverseBits(std::uint32_t value, size_t bits)
+{
+    return (std::uint64_t{BitManip::reverse32(value)} << bits) >> 32;
 }
 
 /*
-Bitwise analyses and manipulation functions
+Universal codes size values with BitManip, so they are defined once it is
 */
-namespace BitManip {
-    
-    /*
-    Count the number of 1-bits in a given number
-    
-    number: a 32-bit unsigned integer
-    
-    returns the number of bits set to 1 in number
-    */
-    inline size_t bitsSet(std::uint32_t number)
-    {
-        number -= (number >> 1) & 0x55555555;
-        number = (number & 0x33333333) + ((number >> 2) & 0x33333333);
-        number = (number & 0x0F0F0F0F) + ((number >> 4) & 0x0F0F0F0F);
-        number = (number & 0x00FF00FF) + ((number >> 8) & 0x00FF00FF);
-        number = (number & 0x0000FFFF) + (number >> 16);
-        return number;
+template <class Sink, BitBuffer::BitOrder Order>
+inline size_t BitBuffer::BitWriter<Sink, Order>::writeGamma(std::uint32_t value)
+{
+    if (value == 0) {
+        throw BitBufferException("value out of range");
+    }
+    // Below its top bit value has as many bits as there are 0-bits before it
+    size_t bits = BitManip::msbSet(value);
+    return write64(value, 2 * bits + 1);
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+inline size_t BitBuffer::BitWriter<Sink, Order>::writeDelta(std::uint32_t value)
+{
+    if (value == 0) {
+        throw BitBufferException("value out of range");
+    }
+    size_t bits = BitManip::msbSet(value);
+    size_t lengthBits = BitManip::msbSet(bits + 1);
+    std::uint64_t code = (std::uint64_t{bits + 1} << bits) | (value ^ (std::uint32_t{1} << bits));
+    return write64(code, 2 * lengthBits + 1 + bits);
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+inline size_t BitBuffer::BitWriter<Sink, Order>::writeRice(std::uint32_t value, size_t k)
+{
+    if (k >= 32) {
+        throw BitBufferException("bit count too high");
+    }
+    size_t quotient = value >> k;
+    std::uint64_t code = (std::uint64_t{1} << k) | (value & ((std::uint64_t{1} << k) - 1));
+    if (quotient + 1 + k <= 64) {
+        return write64(code, quotient + 1 + k);
+    }
+    size_t written = zeros(quotient);
+    return written + write64(code, 1 + k);
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+inline size_t BitBuffer::BitWriter<Sink, Order>::writeExpGolomb(std::uint32_t value, size_t k)
+{
+    if (k >= 32) {
+        throw BitBufferException("bit count too high");
+    }
+    std::uint64_t offset = std::uint64_t{value} + (std::uint64_t{1} << k);
+    size_t bits = BitManip::msbSet64(offset);
+    if (2 * bits + 1 - k <= 64) {
+        return write64(offset, 2 * bits + 1 - k);
+    }
+    size_t written = zeros(bits - k);
+    return written + write64(offset, bits + 1);
+}
+
+/*
+Count the 0-bits before the next 1-bit straight from the window, then consume both
+*/
+template <class Source, BitBuffer::BitOrder Order>
+inline size_t BitBuffer::BitReader<Source, Order>::unary(size_t limit)
+{
+    size_t count = 0;
+    for (;;) {
+        if (bitCount < 32) {
+            refill(32);
+        }
+        // Window bits past bitCount are either 0 or the true upcoming bits
+        size_t run = Order == MSB ? BitManip::leadingZeros64(window) : BitManip::trailingZeros64(window);
+        if (run < bitCount) {
+            count += run;
+            if (count > limit) {
+                throw BitBufferException("Invalid code encountered");
+            }
+            consume(run);
+            consume(1);
+            return count;
+        }
+        count += bitCount;
+        // Once the input has run out the window holds every real bit left, so no 1-bit is coming
+        if (count > limit || exhausted) {
+            throw BitBufferException("Invalid code encountered");
+        }
+        window = 0;
+        bitCount = 0;
+    }
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+inline std::uint32_t BitBuffer::BitReader<Source, Order>::readGamma()
+{
+    size_t bits = unary(31);
+    return (std::uint32_t{1} << bits) | read(bits);
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+inline std::uint32_t BitBuffer::BitReader<Source, Order>::readDelta()
+{
+    size_t lengthBits = unary(5);
+    size_t bits = ((std::uint32_t{1} << lengthBits) | read(lengthBits)) - 1;
+    if (bits > 31) {
+        throw BitBufferException("Invalid code encountered");
+    }
+    return (std::uint32_t{1} << bits) | read(bits);
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+inline std::uint32_t BitBuffer::BitReader<Source, Order>::readRice(size_t k)
+{
+    if (k >= 32) {
+        throw BitBufferException("bit count too high");
+    }
+    std::uint32_t quotient = unary(0xFFFFFFFF >> k);
+    return (quotient << k) | read(k);
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+inline std::uint32_t BitBuffer::BitReader<Source, Order>::readExpGolomb(size_t k)
+{
+    if (k >= 32) {
+        throw BitBufferException("bit count too high");
+    }
+    size_t bits = unary(32 - k) + k;
+    std::uint64_t offset = (std::uint64_t{1} << bits) | read(bits);
+    std::uint64_t value = offset - (std::uint64_t{1} << k);
+    if (value > 0xFFFFFFFF) {
+        throw BitBufferException("Invalid code encountered");
+    }
+    return value;
+}
+
+/*
+The remaining members of BitWriter and BitReader, defined here so that they work with any sink or source
+*/
+template <class Sink, BitBuffer::BitOrder Order>
+BitBuffer::BitWriter<Sink, Order>::~BitWriter()
+{
+    // A span too small for the last bits can not be reported from here
+    try {
+        flush();
+    }
+    catch (BitBufferException&) {}
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+void BitBuffer::BitWriter<Sink, Order>::stage(size_t bits)
+{
+    bitCount -= bits;
+    size_t bytes = bits >> 3;
+    std::uint8_t *out = sink.reserve(bytes);
+    if (Order == MSB) {
+        std::uint64_t word = accumulator >> bitCount;
+        for (size_t i = 0; i < bytes; i++) {
+            out[i] = word >> (bits - 8 * (i + 1));
+        }
+    }
+    else {
+        // The first bits are at the bottom of the accumulator
+        for (size_t i = 0; i < bytes; i++) {
+            out[i] = accumulator >> (8 * i);
+        }
+        accumulator >>= bits;
+    }
+    sink.commit(bytes);
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+void BitBuffer::BitWriter<Sink, Order>::merge(std::uint64_t word)
+{
+    // Fewer than 64 bits are ever left in the accumulator, so the word merges with them into 8 whole bytes
+    std::uint8_t *out = sink.reserve(sizeof(std::uint64_t));
+    if (Order == MSB) {
+        std::uint64_t merged = bitCount ? (accumulator << (64 - bitCount)) | (word >> bitCount) : word;
+        storeBe64(out, merged);
+        accumulator = word;
+    }
+    else {
+        std::uint64_t merged = accumulator | (word << bitCount);
+        storeLe64(out, merged);
+        accumulator = bitCount ? word >> (64 - bitCount) : 0;
+    }
+    sink.commit(sizeof(std::uint64_t));
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitWriter<Sink, Order>::writeData(const unsigned char *mem, size_t bytes)
+{
+    // An empty buffer, such as an empty vector's data, may be null, which must not reach the sink
+    if (bytes == 0) {
+        return 0;
+    }
+    if (Order == MSB && (bitCount & 7) == 0) {
+        // Byte aligned, so the bytes go to the sink exactly as they are
+        if (bitCount) {
+            stage(bitCount);
+        }
+        sink.put(mem, bytes);
+        return bytes;
+    }
+    // Otherwise every 8 bytes make one word of bits in stream order.
+    // LSB first still writes the first bit of each byte as its most significant, so each byte is reversed
+    size_t i = 0;
+    for (; i + sizeof(std::uint64_t) <= bytes; i += sizeof(std::uint64_t)) {
+        std::uint64_t word = Order == MSB ? loadBe64(mem + i) : reverseEachByte(loadLe64(mem + i));
+        merge(word);
+    }
+    for (; i < bytes; i++) {
+        write(mem[i], 8);
+    }
+    return bytes;
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitWriter<Sink, Order>::writeBits(const std::uint64_t *words, size_t nbits)
+{
+    size_t written = ((bitCount & 7) + nbits) >> 3;
+    size_t whole = nbits / 64;
+    for (size_t i = 0; i < whole; i++) {
+        merge(words[i]);
+    }
+    size_t rest = nbits % 64;
+    if (rest) {
+        std::uint64_t word = words[whole];
+        if (Order == MSB) {
+            word >>= 64 - rest;
+            if (rest > 32) {
+                push(word >> 32, rest - 32);
+            }
+            push(word, std::min<size_t>(rest, 32));
+        }
+        else {
+            push(word, std::min<size_t>(rest, 32));
+            if (rest > 32) {
+                push(word >> 32, rest - 32);
+            }
+        }
+    }
+    return written;
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitWriter<Sink, Order>::writeUtf8(std::uint32_t value)
+{
+    size_t written = 0;
+    std::uint8_t buffer[BitManip::UTF8_MAX_LEN];
+    size_t size = BitManip::utf8(value, buffer);
+    for (size_t i = 0; i < size; i++) {
+        written += write(buffer[i], 8);
+    }
+    return written;
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitWriter<Sink, Order>::flush(bool fill)
+{
+    size_t padded = 0;
+    size_t remaining = -bitCount & 7;
+    if (remaining) {
+        if (Order == MSB) {
+            accumulator <<= remaining;
+            if (fill) {
+                accumulator |= (1 << remaining) - 1;
+            }
+        }
+        else if (fill) {
+            accumulator |= std::uint64_t{(1u << remaining) - 1} << bitCount;
+        }
+        bitCount += remaining;
+        padded = 1;
+    }
+    if (bitCount) {
+        stage(bitCount);
+    }
+    sink.flush();
+    return padded;
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitWriter<Sink, Order>::writeGamma(const std::uint32_t *values, size_t n)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        written += writeGamma(values[i]);
+    }
+    return written;
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitWriter<Sink, Order>::writeDelta(const std::uint32_t *values, size_t n)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        written += writeDelta(values[i]);
+    }
+    return written;
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitWriter<Sink, Order>::writeRice(const std::uint32_t *values, size_t n, size_t k)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        written += writeRice(values[i], k);
+    }
+    return written;
+}
+
+template <class Sink, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitWriter<Sink, Order>::writeExpGolomb(const std::uint32_t *values, size_t n, size_t k)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        written += writeExpGolomb(values[i], k);
+    }
+    return written;
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+void BitBuffer::BitReader<Source, Order>::refill(size_t bits)
+{
+    while (bitCount <= 56) {
+        size_t available = source.available();
+        if (available >= sizeof(std::uint64_t)) {
+            // Bits beyond the whole bytes taken are the true upcoming bits, so it is safe to leave them
+            const std::uint8_t *data = source.data();
+            if (Order == MSB) {
+                window |= loadBe64(data) >> bitCount;
+            }
+            else {
+                window |= loadLe64(data) << bitCount;
+            }
+            size_t bytes = (63 - bitCount) >> 3;
+            source.skip(bytes);
+            bitCount += bytes * 8;
+            return;
+        }
+        if (available == 0) {
+            // Only go back to the source for bits that are actually needed, so it is never read further than that
+            if (bitCount >= bits) {
+                return;
+            }
+            if (!source.fetch()) {
+                // The window is zero past the last real bit, so just claim it is full
+                exhausted = true;
+                bitCount = 64;
+                return;
+            }
+            continue;
+        }
+        std::uint64_t byte = *source.data();
+        source.skip(1);
+        if (Order == MSB) {
+            window |= byte << (56 - bitCount);
+        }
+        else {
+            window |= byte << bitCount;
+        }
+        bitCount += 8;
+    }
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitReader<Source, Order>::read(unsigned char *mem, size_t bytes)
+{
+    // An empty buffer may be null, which must not reach take or memset
+    if (bytes == 0) {
+        return 0;
+    }
+    size_t done = 0;
+    if ((bitCount & 7) == 0) {
+        // Byte aligned, so once the whole bytes in the window are used the rest is copied straight from the source.
+        // Window bits past bitCount belong to bytes the source has not skipped yet, so they can be dropped
+        while (bitCount && done < bytes) {
+            mem[done++] = read(8);
+        }
+        if (done < bytes) {
+            window = 0;
+            size_t taken = source.take(mem + done, bytes - done);
+            // Past the end of the input, 0-bits are read
+            std::memset(mem + done + taken, 0, bytes - done - taken);
+            if (Order == LSB) {
+                BitManip::reverseBits(mem + done, taken);
+            }
+        }
+        return bytes;
+    }
+    // Otherwise bits come a block of words at a time, and each word splits into 8 bytes
+    std::uint64_t words[32];
+    while (bytes - done >= sizeof(std::uint64_t)) {
+        size_t count = std::min((bytes - done) / sizeof(std::uint64_t), sizeof(words) / sizeof(words[0]));
+        readBits(words, count * 64);
+        for (size_t i = 0; i < count; i++) {
+            std::uint64_t word = words[i];
+            if (Order == MSB) {
+                storeBe64(mem + done, word);
+            }
+            else {
+                storeLe64(mem + done, reverseEachByte(word));
+            }
+            done += sizeof(std::uint64_t);
+        }
+    }
+    while (done < bytes) {
+        mem[done++] = read(8);
+    }
+    return bytes;
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+size_t BitBuffer::BitReader<Source, Order>::readBits(std::uint64_t *words, size_t nbits)
+{
+    size_t whole = nbits / 64;
+    size_t i = 0;
+    // While the source has 8 bytes ready, each word is the bits in the window merged with those bytes.
+    // Window bits past bitCount are either 0 or the same bits the bytes hold, so they merge harmlessly
+    for (; i < whole && source.available() >= sizeof(std::uint64_t); i++) {
+        const std::uint8_t *data = source.data();
+        if (Order == MSB) {
+            std::uint64_t word = loadBe64(data);
+            words[i] = window | (word >> bitCount);
+            window = bitCount ? word << (64 - bitCount) : 0;
+        }
+        else {
+            std::uint64_t word = loadLe64(data);
+            words[i] = (window & ((std::uint64_t{1} << bitCount) - 1)) | (word << bitCount);
+            window = bitCount ? word >> (64 - bitCount) : 0;
+        }
+        source.skip(sizeof(std::uint64_t));
+    }
+    for (; i < whole; i++) {
+        std::uint64_t first = readNative(32);
+        std::uint64_t second = readNative(32);
+        words[i] = Order == MSB ? (first << 32) | second : (second << 32) | first;
+    }
+    size_t rest = nbits % 64;
+    if (rest) {
+        std::uint64_t first = readNative(std::min<size_t>(rest, 32));
+        std::uint64_t second = rest > 32 ? readNative(rest - 32) : 0;
+        if (Order == MSB) {
+            std::uint64_t word = rest > 32 ? (first << (rest - 32)) | second : first;
+            words[whole] = word << (64 - rest);
+        }
+        else {
+            words[whole] = (second << 32) | first;
+        }
+    }
+    return nbits;
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+std::uint32_t BitBuffer::BitReader<Source, Order>::readUtf8()
+{
+    std::uint8_t buffer[BitManip::UTF8_MAX_LEN];
+    buffer[0] = read(8);
+    size_t bytesLeft = BitManip::utf8BytesLeft(buffer[0]);
+    if (bytesLeft > 5) {
+        throw BitBufferException("Invalid UTF-8 sequence encountered");
+    }
+    for (size_t i = 0; i < bytesLeft; i++) {
+        buffer[i + 1] = read(8);
+    }
+    std::uint32_t codepoint;
+    size_t success = BitManip::utf8(buffer, codepoint);
+    if (success == 0) {
+        throw BitBufferException("Invalid UTF-8 sequence encountered");
+    }
+    return codepoint;
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+void BitBuffer::BitReader<Source, Order>::readGamma(std::uint32_t *values, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        values[i] = readGamma();
+    }
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+void BitBuffer::BitReader<Source, Order>::readDelta(std::uint32_t *values, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        values[i] = readDelta();
+    }
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+void BitBuffer::BitReader<Source, Order>::readRice(std::uint32_t *values, size_t n, size_t k)
+{
+    for (size_t i = 0; i < n; i++) {
+        values[i] = readRice(k);
+    }
+}
+
+template <class Source, BitBuffer::BitOrder Order>
+void BitBuffer::BitReader<Source, Order>::readExpGolomb(std::uint32_t *values, size_t n, size_t k)
+{
+    for (size_t i = 0; i < n; i++) {
+        values[i] = readExpGolomb(k);
     }
+}
+
+/*
+The built-in sinks and sources are instantiated once, in the library
+*/
+extern template class BitBuffer::BitWriter<BitBuffer::StreamSink, BitBuffer::MSB>;
+extern template class BitBuffer::BitWriter<BitBuffer::StreamSink, BitBuffer::LSB>;
+extern template class BitBuffer::BitWriter<BitBuffer::SpanSink, BitBuffer::MSB>;
+extern template class BitBuffer::BitWriter<BitBuffer::SpanSink, BitBuffer::LSB>;
+extern template class BitBuffer::BitWriter<BitBuffer::VectorSink, BitBuffer::MSB>;
+extern template class BitBuffer::BitWriter<BitBuffer::VectorSink, BitBuffer::LSB>;
+extern template class BitBuffer::BitReader<BitBuffer::StreamSource, BitBuffer::MSB>;
+extern template class BitBuffer::BitReader<BitBuffer::StreamSource, BitBuffer::LSB>;
+extern template class BitBuffer::BitReader<BitBuffer::SpanSource, BitBuffer::MSB>;
+extern template class BitBuffer::BitReader<BitBuffer::SpanSource, BitBuffer::LSB>;
+
+namespace Huffman {
     
     /*
-    Count the number of contiguous 0-bits starting at MSB
-    
-    number: a 32-bit unsigned integer
-    
-    returns the number of leading zeros
+    Number of bits looked up at once by the first level of a decode table
     */
-    inline size_t leadingZeros(std::uint32_t number)
-    {
-#if defined(_MSC_VER)
-        long mask;
-        if (_BitScanReverse(&mask, number))
-            return sizeof(std::uint32_t) * 8 - 1 - mask;
-        return sizeof(std::uint32_t) * 8;
-#elif defined(__GNUC__)
-        if (number == 0)
-            return sizeof(std::uint32_t) * 8;
-        return __builtin_clz(number);
-#else
-        number |= number >> 16;
-        number |= number >> 8;
-        number |= number >> 4;
-        number |= number >> 2;
-        number |= number >> 1;
-        return sizeof(std::uint32_t) * 8 - bitsSet(number);
-#endif
-    }
+    constexpr size_t TABLE_BITS = 9;
     
     /*
-    Count the number of contiguous 0-bits ending with LSB
-    
-    number: a 32-bit unsigned integer
-    
-    returns the number of trailing zeros
+    Decode tables hold codes up to this long. Longer codes are looked up by their first
+    TABLE_MAX_LENGTH bits and then finished bit by bit
     */
-    inline size_t trailingZeros(std::uint32_t number)
-    {
-#if defined(_MSC_VER)
-        long mask;
-        if (_BitScanForward(&mask, number))
-            return mask;
-        return sizeof(std::uint32_t) * 8;
-#elif defined(__GNUC__)
-        if (number == 0)
-            return sizeof(std::uint32_t) * 8;
-        return __builtin_ctz(number);
-#else
-        number |= number << 16;
-        number |= number << 8;
-        number |= number << 4;
-        number |= number << 2;
-        number |= number << 1;
-        return sizeof(std::uint32_t) * 8 - bitsSet(number);
-#endif
-    }
+    constexpr size_t TABLE_MAX_LENGTH = 16;
     
     /*
-    Find the position of the most significant 1-bit
-    
-    number: a 32-bit unsigned integer
-    
-    returns the 0-index position of the set MSB, or 32 for 0
+    Codes are held in an int, so a HuffmanCode has no code longer than this
     */
-    inline size_t msbSet(std::uint32_t number)
-    {
-#if defined(_MSC_VER)
-        long mask;
-        if (_BitScanReverse(&mask, number))
-            return mask;
-        return sizeof(std::uint32_t) * 8;
-#elif defined(__GNUC__)
-        if (number == 0)
-            return sizeof(std::uint32_t) * 8;
-        return sizeof(std::uint32_t) * 8 - 1 - __builtin_clz(number);
-#else
-        if (number == 0)
-            return sizeof(std::uint32_t) * 8;
-        number |= number >> 16;
-        number |= number >> 8;
-        number |= number >> 4;
-        number |= number >> 2;
-        number |= number >> 1;
-        return bitsSet(number) - 1;
-#endif
-    }
+    constexpr size_t MAX_CODE_LENGTH = 31;
     
     /*
-    Find the position of the least significant 1-bit
-    
-    number: a 32-bit unsigned integer
-    
-    returns the 0-index position of the set LSB, or 32 for 0
+    Default number of bits looked up at once by a table decoding two symbols per lookup
     */
-    inline size_t lsbSet(std::uint32_t number)
-    {
-#if defined(_MSC_VER)
-        long mask;
-        if (_BitScanForward(&mask, number))
-            return mask;
-        return sizeof(std::uint32_t) * 8;
-#elif defined(__GNUC__)
-        if (number == 0)
-            return sizeof(std::uint32_t) * 8;
-        return __builtin_ctz(number);
-#else
-        if (number == 0)
-            return sizeof(std::uint32_t) * 8;
-        number |= number << 16;
-        number |= number << 8;
-        number |= number << 4;
-        number |= number << 2;
-        number |= number << 1;
-        return sizeof(std::uint32_t) * 8 - bitsSet(number);
-#endif
-    }
+    constexpr size_t MULTI_TABLE_BITS = 11;
     
     /*
-    Reverse the order of bits in an 8-bit integer
-    
-    number: 8-bit unsigned integer to reverse
-    
-    returns the bitwise reversal of number
+    Symbols are encoded through a flat table when the non-negative ones are at least this dense
+    (no more than this many table entries per symbol)
     */
-    inline std::uint8_t reverse8(std::uint8_t number)
-    {
-        number = ((number & 0xF0) >> 4) | ((number & 0x0F) << 4);
-        number = ((number & 0xCC) >> 2) | ((number & 0x33) << 2);
-        number = ((number & 0xAA) >> 1) | ((number & 0x55) << 1);
-        return number;
-    }
-    
-// #define UTF8_MAX_LEN 6
-    constexpr int UTF8_MAX_LEN = 6;
+    constexpr size_t ENCODE_TABLE_SPREAD = 4;
     
     /*
-    Convert an integer to the UTF-8 representation
+    Codes longer than this keep symbols out of the flat encode table
+    */
+    constexpr size_t ENCODE_TABLE_MAX_LENGTH = 26;
     
-    returns the number of bytes needed to represent v
+    /*
+    Entries of the flat encode table pack a code above its length in this many bits, 0 marking an absent symbol
     */
-    size_t utf8(std::uint32_t v, std::uint8_t *dst);
+    constexpr size_t ENCODE_LENGTH_BITS = 5;
     
     /*
-    Convert UTF-8 to a single integer
+    One entry of a table-driven Huffman decoder
     
-    returns the number of bytes used, 0 for failure
+    symbol: The decoded symbol, or the index of a secondary table
+    length: Number of bits the code takes up in this table level, 0 if no code matches
+        or, in a secondary table, if the code is longer than TABLE_MAX_LENGTH
+    subBits: Number of further bits indexing the secondary table, 0 for a decoded symbol
     */
-    size_t utf8(std::uint8_t *src, std::uint32_t &v);
+    struct HuffmanTableEntry {
+        std::int32_t symbol;
+        std::uint8_t length;
+        std::uint8_t subBits;
+    };
     
     /*
-    Given a first UTF-8 byte, how many more are there for this codepoint?
-    */
-    inline size_t utf8BytesLeft(std::uint8_t firstByte)
-    {
-        size_t firstZero = msbSet((std::uint8_t)~firstByte);
-        if (firstZero == 7) {
-            return 0;
-        }
-        return 6 - firstZero;
-    }
+    One entry of a table-driven Huffman decoder that can decode two symbols at once
     
-}
-
-namespace Huffman {
+    symbols: The decoded symbols, the second repeating the first if there is only one
+    length: Number of bits the codes of the decoded symbols take up together
+    count: Number of symbols decoded, 0 if the next code is longer than the table's bits
+    */
+    struct HuffmanMultiEntry {
+        std::int32_t symbols[2];
+        std::uint8_t length;
+        std::uint8_t count;
+    };
     
     /*
     A huffman code/tree for integer symbols
     */
     class HuffmanCode {
         private:
-            std::vector<std::map<int, int>> decode;
-            std::map<int, std::pair<int, size_t>> encode;
+            std::vector<std::vector<int>> decode;
+            std::vector<int> firstCodes;
+            std::vector<std::pair<int, std::pair<int, size_t>>> encode;
+            std::vector<HuffmanTableEntry> decodeTable;
+            std::vector<HuffmanTableEntry> reversedDecodeTable;
+            size_t tableBits;
+            std::vector<HuffmanMultiEntry> multiTable;
+            std::vector<HuffmanMultiEntry> reversedMultiTable;
+            size_t multiBits;
+            std::vector<std::uint32_t> encodeTable;
+            std::vector<std::uint32_t> reversedEncodeTable;
             void initFromList(std::vector<std::vector<int>>& symbolsList);
+            void initFromLengths(const std::uint8_t *lengths, size_t n);
+            void buildDecodeTable();
+            void buildEncodeTable();
+            template <class Reader>
+            bool readBitwise(Reader& buffer, int code, size_t length, int& output) const;
+            template <BitBuffer::BitOrder Order>
+            bool readStreams(const std::uint8_t *const *starts, const std::uint8_t *const *ends, int *symbols, size_t n) const;
         public:
             
             /*
             Construct the code from a list of every symbol of each symbol length
             
-            symbolsList: Each integer in symbolsList[x] represents a symbol with code length x+1
+            symbolsList: Each integer in symbolsList[x] represents a symbol with code length x+1.
+                Throws HuffmanException if a symbol is listed beyond MAX_CODE_LENGTH
             */
             HuffmanCode(std::vector<std::vector<int>>& symbolsList);
             
@@ -374,9 +2629,29 @@ namespace Huffman {
             Construct the code from a frequency table, optionally limiting code length
             
             frequencies: A map of symbol to relative frequency
-            limit: The maximum code length, or 0 for no limit
+            limit: The maximum code length, or 0 for no limit short of MAX_CODE_LENGTH
+            */
+            HuffmanCode(const std::map<int, int>& frequencies, size_t limit = 0);
+            
+            /*
+            Construct the code from a histogram of the symbols 0 to n - 1, optionally limiting code length.
+            Symbols that never occur get no code
+            
+            histogram: Number of occurrences of each symbol
+            n: Number of symbols in the alphabet
+            limit: The maximum code length, or 0 for no limit short of MAX_CODE_LENGTH
+            */
+            HuffmanCode(const std::uint32_t *histogram, size_t n, size_t limit = 0);
+            
+            /*
+            Construct the canonical code with the given code lengths, as DEFLATE transmits codes.
+            Codes of one length go to their symbols in increasing order
+            
+            lengths: Code length of each of the symbols 0 to n - 1, 0 for a symbol with no code.
+                Throws HuffmanException if one is longer than MAX_CODE_LENGTH
+            n: Number of symbols in the alphabet
             */
-            HuffmanCode(std::map<int, int>& frequencies, size_t limit = 0);
+            HuffmanCode(const std::uint8_t *lengths, size_t n);
             
             /*
             Get the code and code lengths for a given symbol
@@ -389,13 +2664,14 @@ namespace Huffman {
             bool write(int symbol, int& code, size_t& length) const;
             
             /*
-            Write a symbol to a BitBufferOut
+            Write a symbol to a bit buffer or BitWriter
             
             symbol: Symbol to write
             buffer: Output buffer to write to
             returns true if a code was found
             */
-            bool write(int symbol, BitBuffer::BitBufferOut& buffer) const;
+            template <class Writer>
+            bool write(int symbol, Writer& buffer) const;
             
             /*
             Find the symbol that matches a code and length
@@ -408,13 +2684,52 @@ namespace Huffman {
             bool read(int code, size_t length, int& output) const;
             
             /*
-            Read the next symbol from a bit input
+            Read the next symbol from a bit buffer or BitReader
             
             buffer: Source of bits
             output out: Matched symbol if any
             returns true if a symbol was found
             */
-            bool read(BitBuffer::BitBufferIn& buffer, int& output) const;
+            template <class Reader>
+            bool read(Reader& buffer, int& output) const;
+            
+            /*
+            Encode a block of symbols as four separately bit-packed streams, as zstd does for literals,
+            so that readStreams can decode them side by side. The block starts with the byte sizes of
+            the first three streams, 4 little-endian bytes each, followed by the four streams.
+            Stream k holds the symbols from k * q up to (k + 1) * q, q being n / 4 rounded up
+            
+            symbols: Symbols to encode
+            n: Number of symbols
+            out: Vector the block is appended to
+            order: Bit order of the streams, defaults to MSB first
+            returns true if every symbol had a code, otherwise out is left as it was
+            */
+            bool writeStreams(const int *symbols, size_t n, std::vector<std::uint8_t>& out,
+                BitBuffer::BitOrder order = BitBuffer::MSB) const;
+            
+            /*
+            Decode a block written by writeStreams, interleaving the table lookups of its four streams
+            
+            data: Start of the block
+            size: Size of the block in bytes
+            symbols out: Decoded symbols
+            n: Number of symbols in the block
+            order: Bit order of the streams, defaults to MSB first
+            returns true if each stream held its symbols within its own bytes
+            */
+            bool readStreams(const std::uint8_t *data, size_t size, int *symbols, size_t n,
+                BitBuffer::BitOrder order = BitBuffer::MSB) const;
+            
+            /*
+            Build a further decode table whose entries hold every pair of codes that fits in its bits,
+            which readStreams then uses to decode up to two symbols per lookup.
+            This pays off when most codes are short, as with heavily skewed data
+            
+            bits: Number of bits looked up at once, from 1 to TABLE_MAX_LENGTH.
+                The table has 2 to the power of bits entries
+            */
+            void buildMultiSymbolTable(size_t bits = MULTI_TABLE_BITS);
             
             /*
             returns a vector of the number of symbols of each code length
@@ -427,6 +2742,78 @@ namespace Huffman {
             std::vector<std::vector<int>> orderedSymbols() const;
     };
     
+    template <class Writer>
+    inline bool HuffmanCode::write(int symbol, Writer& buffer) const
+    {
+        if (static_cast<size_t>(symbol) < encodeTable.size()) {
+            // LSB first streams take codes already reversed, so nothing is reversed per symbol
+            std::uint32_t entry = buffer.bitOrder() == BitBuffer::LSB ? reversedEncodeTable[symbol] : encodeTable[symbol];
+            if (entry == 0) {
+                return false;
+            }
+            buffer.writeNative(entry >> ENCODE_LENGTH_BITS, entry & ((1 << ENCODE_LENGTH_BITS) - 1));
+            return true;
+        }
+        int code;
+        size_t length;
+        if (!write(symbol, code, length)) {
+            return false;
+        }
+        buffer.write(code, length);
+        return true;
+    }
+    
+    template <class Reader>
+    inline bool HuffmanCode::read(Reader& buffer, int& output) const
+    {
+        if (tableBits) {
+            // LSB first streams index a table laid out for reversed bits, so nothing is reversed per symbol
+            const HuffmanTableEntry *table = buffer.bitOrder() == BitBuffer::LSB ? reversedDecodeTable.data() : decodeTable.data();
+            std::uint32_t prefix = buffer.peekNative(tableBits);
+            const HuffmanTableEntry *entry = &table[prefix];
+            if (entry->subBits) {
+                buffer.consume(tableBits);
+                entry = &table[entry->symbol + buffer.peekNative(entry->subBits)];
+                if (entry->length == 0) {
+                    // The code may be too long for the table, so carry on from the bits already consumed
+                    if (buffer.bitOrder() == BitBuffer::LSB) {
+                        prefix = BitBuffer::reverseBits(prefix, tableBits);
+                    }
+                    return readBitwise(buffer, prefix, tableBits, output);
+                }
+            }
+            if (entry->length == 0) {
+                return false;
+            }
+            buffer.consume(entry->length);
+            output = entry->symbol;
+            return true;
+        }
+        return readBitwise(buffer, 0, 0, output);
+    }
+    
+    /*
+    Finish reading a code one bit at a time
+    
+    buffer: The reader to take further bits from
+    code: The bits of the code read so far
+    length: Number of bits of the code read so far
+    output out: The decoded symbol
+    returns true if a valid code was read
+    */
+    template <class Reader>
+    inline bool HuffmanCode::readBitwise(Reader& buffer, int code, size_t length, int& output) const
+    {
+        while (length < decode.size()) {
+            code = (code << 1) | buffer.read(1);
+            length++;
+            if (read(code, length, output)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
     /*
     Exception thrown when a Huffman code could not be generated
     */
@@ -438,6 +2825,55 @@ namespace Huffman {
             virtual const char* what();
     };
     
+    /*
+    Compute optimal code lengths in place with Moffat and Katajainen's algorithm, without building a tree
+    
+    weights: n symbol weights sorted in non-decreasing order, each replaced by the code length of its symbol.
+        A lone symbol gets length 1
+    n: Number of weights
+    */
+    void sortedCodeLengths(std::uint64_t *weights, size_t n);
+    
+    /*
+    Compute optimal code lengths no longer than a limit with the package-merge algorithm
+    
+    weights: n symbol weights sorted in non-decreasing order
+    n: Number of weights
+    limit: The maximum code length, throws HuffmanException if n symbols do not fit in codes this long
+    lengths out: The code length of each weight's symbol
+    */
+    void sortedLimitedCodeLengths(const std::uint64_t *weights, size_t n, size_t limit, std::uint8_t *lengths);
+    
+    /*
+    Compute the code lengths of an optimal code for a histogram, without building a tree or a map
+    
+    histogram: Number of occurrences of each of the symbols 0 to n - 1
+    n: Number of symbols in the alphabet
+    lengths out: Code length of each symbol, 0 for symbols that never occur
+    limit: The maximum code length, or 0 for no limit
+    returns the longest code length
+    */
+    size_t codeLengths(const std::uint32_t *histogram, size_t n, std::uint8_t *lengths, size_t limit = 0);
+    
+    /*
+    Count the occurrences of each byte value, ready to build a HuffmanCode over the 256 byte values
+    
+    data: Bytes to count
+    n: Number of bytes
+    histogram out: Number of occurrences of each byte value
+    */
+    void histogram(const std::uint8_t *data, size_t n, std::uint32_t histogram[256]);
+    
+    /*
+    Count the occurrences of each byte value, splitting large inputs between threads
+    
+    data: Bytes to count
+    n: Number of bytes
+    histogram out: Number of occurrences of each byte value
+    threads: Most threads to count with, or 0 for as many as the hardware runs at once
+    */
+    void histogram(const std::uint8_t *data, size_t n, std::uint32_t histogram[256], size_t threads);
+    
 }
 
 namespace Digest {
@@ -486,7 +2922,66 @@ namespace Digest {
         return crc16(vec.data(), vec.size(), start);
     }
     
+    std::uint32_t crc32_base(const std::uint8_t *data, size_t n, std::uint32_t start = 0);
+    
+    /*
+    Calculate and accumulate the CRC32 of some data, as used by zlib, gzip and PNG
+    
+    data: Pointer to data
+    n: Number of T elements to checksum (number of T, not bytes)
+    start: CRC32 of the preceding data, defaults to 0
+    returns the 32-bit CRC32 with reflected polynomial 0xEDB88320
+    */
+    template <class T>
+    inline std::uint32_t crc32(const T *data, size_t n, std::uint32_t start = 0)
+    {
+        return crc32_base(reinterpret_cast<const std::uint8_t*>(data), n * sizeof(T), start);
+    }
+    
+    std::uint32_t crc32c_base(const std::uint8_t *data, size_t n, std::uint32_t start = 0);
+    
+    /*
+    Calculate and accumulate the CRC32C (Castagnoli) of some data
+    
+    data: Pointer to data
+    n: Number of T elements to checksum (number of T, not bytes)
+    start: CRC32C of the preceding data, defaults to 0
+    returns the 32-bit CRC32C with reflected polynomial 0x82F63B78
+    */
+    template <class T>
+    inline std::uint32_t crc32c(const T *data, size_t n, std::uint32_t start = 0)
+    {
+        return crc32c_base(reinterpret_cast<const std::uint8_t*>(data), n * sizeof(T), start);
+    }
+    
+    template <class T>
+    inline std::uint32_t crc32(const std::vector<T>& vec, std::uint32_t start = 0)
+    {
+        return crc32(vec.data(), vec.size(), start);
+    }
+    
+    template <class T>
+    inline std::uint32_t crc32c(const std::vector<T>& vec, std::uint32_t start = 0)
+    {
+        return crc32c(vec.data(), vec.size(), start);
+    }
+    
+    /*
+    Combine the CRCs of two consecutive pieces of data in O(log lengthB) time,
+    so that pieces can be checksummed independently, e.g. on separate threads
+    
+    crcA: CRC of the first piece, with any start value
+    crcB: CRC of the second piece, with a start value of 0
+    lengthB: Length in bytes of the second piece
+    returns the CRC of both pieces in order, as if accumulated in one pass
+    */
+    std::uint8_t crc8_combine(std::uint8_t crcA, std::uint8_t crcB, size_t lengthB);
+    std::uint16_t crc16_combine(std::uint16_t crcA, std::uint16_t crcB, size_t lengthB);
+    std::uint32_t crc32_combine(std::uint32_t crcA, std::uint32_t crcB, size_t lengthB);
+    std::uint32_t crc32c_combine(std::uint32_t crcA, std::uint32_t crcB, size_t lengthB);
+    
     constexpr size_t MD5_BUFFER_SIZE = 16;
+    constexpr size_t MD5_DIGEST_SIZE = 16;
     constexpr std::uint32_t MD5_A = 0x67452301;
     constexpr std::uint32_t MD5_B = 0xefcdab89;
     constexpr std::uint32_t MD5_C = 0x98badcfe;
@@ -500,8 +2995,8 @@ namespace Digest {
             size_t bytesProcessed;
             size_t bufferIndex;
             std::uint32_t a, b, c, d;
-            std::uint32_t buffer[MD5_BUFFER_SIZE];
-            void processBuffer();
+            std::uint8_t buffer[MD5_BUFFER_SIZE * sizeof(std::uint32_t)];
+            void processBlocks(const std::uint8_t *data, size_t blocks);
         public:
             MD5Context() :
                 bytesProcessed{0},
@@ -544,6 +3039,39 @@ namespace Digest {
             std::vector<std::uint8_t> finalize();
     };
     
+    /*
+    Compute the MD5 digests of many independent messages, hashing as many of them in parallel
+    as the CPU has SIMD lanes (4 with SSE2, 8 with AVX2, 16 with AVX-512)
+    
+    messages: Pointer to each message
+    lengths: Length in bytes of each message
+    count: Number of messages
+    digests out: count * MD5_DIGEST_SIZE bytes, receiving the digest of each message in order
+    */
+    void md5Batch(const std::uint8_t *const *messages, const size_t *lengths, size_t count, std::uint8_t *digests);
+    
+    /*
+    Compute the MD5 digest of each of a list of vectors, as MD5Context::finalize would return it
+    */
+    template <class T>
+    inline std::vector<std::vector<std::uint8_t>> md5Batch(const std::vector<std::vector<T>>& messages)
+    {
+        std::vector<const std::uint8_t*> pointers;
+        std::vector<size_t> lengths;
+        for (auto it = messages.begin(); it != messages.end(); it++) {
+            pointers.push_back(reinterpret_cast<const std::uint8_t*>(it->data()));
+            lengths.push_back(it->size() * sizeof(T));
+        }
+        std::vector<std::uint8_t> digests(messages.size() * MD5_DIGEST_SIZE);
+        md5Batch(pointers.data(), lengths.data(), messages.size(), digests.data());
+        std::vector<std::vector<std::uint8_t>> ret;
+        for (size_t i = 0; i < messages.size(); i++) {
+            ret.push_back(std::vector<std::uint8_t>(digests.begin() + i * MD5_DIGEST_SIZE,
+                digests.begin() + (i + 1) * MD5_DIGEST_SIZE));
+        }
+        return ret;
+    }
+    
 }
 
 #endif
\ No newline at end of file
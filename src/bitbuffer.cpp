@@ -6,146 +6,71 @@ bitbuffer.cpp
 #include <sstream>
 #include <cstdint>
 #include <map>
+#include <algorithm>
+#include <cstring>
 #include "bitutil.hpp"
 
-BitBuffer::BitBufferOut::~BitBufferOut()
+void BitBuffer::StreamSink::drain()
 {
-    flush();
+    stream.write(reinterpret_cast<const char*>(block.data()), staged);
+    staged = 0;
 }
 
-void BitBuffer::BitBufferOut::reset()
+void BitBuffer::StreamSink::put(const std::uint8_t *data, size_t bytes)
 {
-    index = 0;
-    building = 0;
-}
-
-void BitBuffer::BitBufferOut::push()
-{
-    if (order == LSB) {
-        building = ((building & 0xF0) >> 4) | ((building & 0x0F) << 4);
-        building = ((building & 0xCC) >> 2) | ((building & 0x33) << 2);
-        building = ((building & 0xAA) >> 1) | ((building & 0x55) << 1);
-    }
-    stream.write(reinterpret_cast<const char*>(&building), sizeof(BITBUFFER_T));
-    stream.flush();
-}
-
-size_t BitBuffer::BitBufferOut::write(std::uint32_t value, size_t bits)
-{
-    if (bits > 32) {
-        throw BitBufferException("bit count too high");
-    }
-    int written = 0;
-    while (bits) {
-        size_t bitsToAppend = std::min(sizeof(BITBUFFER_T) * 8 - index, bits);
-        size_t shift = bits - bitsToAppend;
-        std::uint32_t mask = ((std::uint32_t{1} << bitsToAppend) - 1);
-        building <<= bitsToAppend;
-        building |= (value >> shift) & mask;
-        index += bitsToAppend;
-        if (index == sizeof(BITBUFFER_T) * 8) {
-            written++;
-            push();
-            index = 0;
-        }
-        bits -= bitsToAppend;
+    if (staged + bytes < blockSize) {
+        std::memcpy(block.data() + staged, data, bytes);
+        staged += bytes;
+        return;
     }
-    return written;
-}
-
-
-size_t BitBuffer::BitBufferOut::writeData(const unsigned char *mem, size_t bytes)
-{
-    size_t written = 0;
-    for (size_t byte = 0; byte < bytes; byte++) {
-        written += write(*mem++, 8);
+    drain();
+    stream.write(reinterpret_cast<const char*>(data), bytes);
+    if (blockSize == 0) {
+        stream.flush();
     }
-    return written;
 }
 
-size_t BitBuffer::BitBufferOut::writeUtf8(std::uint32_t value)
+void BitBuffer::StreamSink::flush()
 {
-    size_t written = 0;
-    std::uint8_t buffer[BitManip::UTF8_MAX_LEN];
-    size_t size = BitManip::utf8(value, buffer);
-    for (size_t i = 0; i < size; i++) {
-        written += write(buffer[i], 8);
-    }
-    return written;
-}
-
-size_t BitBuffer::BitBufferOut::flush(bool fill)
-{
-    if (index == 0) {
-        return 0;
-    }
-    size_t remaining = 8 * sizeof(BITBUFFER_T) - index;
-    building <<= remaining;
-    if (fill) {
-        building |= (1 << remaining) - 1;
-    }
-    push();
-    index = 0;
-    return 1;
+    drain();
+    stream.flush();
 }
 
-void BitBuffer::BitBufferIn::fetch()
+void BitBuffer::VectorSink::grow(size_t bytes)
 {
-    stream.read(reinterpret_cast<char*>(&building), sizeof(BITBUFFER_T));
-    if (order == LSB) {
-        building = BitManip::reverse8(building);
-    }
+    vec.resize(std::max(vec.size() * 2, size + std::max(bytes, BLOCK_SIZE)));
 }
 
-std::uint32_t BitBuffer::BitBufferIn::read(size_t bits)
+size_t BitBuffer::StreamSource::take(std::uint8_t *dst, size_t bytes)
 {
-    if (bits > 32) {
-        throw BitBufferException("bit count too high");
-    }
-    std::uint32_t val = 0;
-    while (bits) {
-        if (index == sizeof(BITBUFFER_T) * 8) {
-            fetch();
-            index = 0;
-        }
-        size_t remaining = std::min(sizeof(BITBUFFER_T) * 8 - index, bits);
-        size_t shift = sizeof(BITBUFFER_T) * 8 - index - remaining;
-        val <<= remaining;
-        std::uint32_t mask = (std::uint32_t{1} << remaining) - 1;
-        mask <<= shift;
-        val |= (building & mask) >> shift;
-        index += remaining;
-        bits -= remaining;
+    size_t buffered = std::min(bytes, end - index);
+    std::memcpy(dst, block.data() + index, buffered);
+    index += buffered;
+    if (buffered == bytes) {
+        return bytes;
     }
-    return val;
+    stream.read(reinterpret_cast<char*>(dst + buffered), bytes - buffered);
+    return buffered + stream.gcount();
 }
 
-size_t BitBuffer::BitBufferIn::read(unsigned char *mem, size_t bytes)
+bool BitBuffer::StreamSource::fetch()
 {
-    for (size_t i = 0; i < bytes; i++) {
-        mem[i] = read(8);
-    }
-    return bytes;
+    stream.read(reinterpret_cast<char*>(block.data()), block.size());
+    index = 0;
+    end = stream.gcount();
+    return end != 0;
 }
 
-std::uint32_t BitBuffer::BitBufferIn::readUtf8()
-{
-    std::uint8_t buffer[BitManip::UTF8_MAX_LEN];
-    buffer[0] = read(8);
-    size_t bytesLeft = BitManip::utf8BytesLeft(buffer[0]);
-    if (bytesLeft > 5) {
-        throw BitBufferException("Invalid UTF-8 sequence encountered");
-    }
-    for (size_t i = 0; i < bytesLeft; i++) {
-        buffer[i + 1] = read(8);
-    }
-    std::uint32_t codepoint;
-    size_t success = BitManip::utf8(buffer, codepoint);
-    if (success == 0) {
-        throw BitBufferException("Invalid UTF-8 sequence encountered");
-    }
-    return codepoint;
-}
+template class BitBuffer::BitWriter<BitBuffer::StreamSink, BitBuffer::MSB>;
+template class BitBuffer::BitWriter<BitBuffer::StreamSink, BitBuffer::LSB>;
+template class BitBuffer::BitWriter<BitBuffer::SpanSink, BitBuffer::MSB>;
+template class BitBuffer::BitWriter<BitBuffer::SpanSink, BitBuffer::LSB>;
+template class BitBuffer::BitWriter<BitBuffer::VectorSink, BitBuffer::MSB>;
+template class BitBuffer::BitWriter<BitBuffer::VectorSink, BitBuffer::LSB>;
+template class BitBuffer::BitReader<BitBuffer::StreamSource, BitBuffer::MSB>;
+template class BitBuffer::BitReader<BitBuffer::StreamSource, BitBuffer::LSB>;
+template class BitBuffer::BitReader<BitBuffer::SpanSource, BitBuffer::MSB>;
+template class BitBuffer::BitReader<BitBuffer::SpanSource, BitBuffer::LSB>;
 
 const char* BitBuffer::BitBufferException::what()
 {
@@ -0,0 +1,365 @@
+/*
+bitmanip.cpp
+*/
+
+#include <cstdint>
+#include <cstring>
+#include "bitutil.hpp"
+
+#ifdef BITUTIL_X86_64
+#include <immintrin.h>
+#endif
+
+/*
+Words (or vectors) folded through the carry-save adders before one population count
+*/
+#define HARLEY_SEAL_BLOCK 16
+
+typedef size_t (*PopcountKernel)(const std::uint64_t *words, size_t n);
+
+/*
+Kernels for the in place bulk reversals
+*/
+struct SwapKernels {
+    void (*reverseBits)(std::uint8_t *data, size_t n);
+    void (*byteswap16)(std::uint16_t *data, size_t n);
+    void (*byteswap32)(std::uint32_t *data, size_t n);
+    void (*byteswap64)(std::uint64_t *data, size_t n);
+};
+
+/*
+Carry-save adder: high gets the carry bits and low the sum bits of a + b + c
+*/
+template <class T>
+static inline void csa(T& high, T& low, T a, T b, T c)
+{
+    T u = a ^ b;
+    high = (a & b) | (u & c);
+    low = u ^ c;
+}
+
+static inline size_t popcountSwar(std::uint64_t word)
+{
+    word -= (word >> 1) & 0x5555555555555555;
+    word = (word & 0x3333333333333333) + ((word >> 2) & 0x3333333333333333);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0F;
+    return (word * 0x0101010101010101) >> 56;
+}
+
+/*
+Harley-Seal: sixteen words go through a tree of carry-save adders so that only the
+sixteens word of each block needs a full population count
+*/
+static size_t popcountScalar(const std::uint64_t *words, size_t n)
+{
+    std::uint64_t ones = 0, twos = 0, fours = 0, eights = 0, sixteens;
+    std::uint64_t twosA, twosB, foursA, foursB, eightsA, eightsB;
+    size_t total = 0;
+    size_t i = 0;
+    for (; i + HARLEY_SEAL_BLOCK <= n; i += HARLEY_SEAL_BLOCK) {
+        const std::uint64_t *w = words + i;
+        csa(twosA, ones, ones, w[0], w[1]);
+        csa(twosB, ones, ones, w[2], w[3]);
+        csa(foursA, twos, twos, twosA, twosB);
+        csa(twosA, ones, ones, w[4], w[5]);
+        csa(twosB, ones, ones, w[6], w[7]);
+        csa(foursB, twos, twos, twosA, twosB);
+        csa(eightsA, fours, fours, foursA, foursB);
+        csa(twosA, ones, ones, w[8], w[9]);
+        csa(twosB, ones, ones, w[10], w[11]);
+        csa(foursA, twos, twos, twosA, twosB);
+        csa(twosA, ones, ones, w[12], w[13]);
+        csa(twosB, ones, ones, w[14], w[15]);
+        csa(foursB, twos, twos, twosA, twosB);
+        csa(eightsB, fours, fours, foursA, foursB);
+        csa(sixteens, eights, eights, eightsA, eightsB);
+        total += popcountSwar(sixteens);
+    }
+    total = 16 * total + 8 * popcountSwar(eights) + 4 * popcountSwar(fours) + 2 * popcountSwar(twos) + popcountSwar(ones);
+    for (; i < n; i++) {
+        total += popcountSwar(words[i]);
+    }
+    return total;
+}
+
+static void reverseBitsScalar(std::uint8_t *data, size_t n)
+{
+    size_t i = 0;
+    for (; i + sizeof(std::uint64_t) <= n; i += sizeof(std::uint64_t)) {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        word = ((word & 0xF0F0F0F0F0F0F0F0) >> 4) | ((word & 0x0F0F0F0F0F0F0F0F) << 4);
+        word = ((word & 0xCCCCCCCCCCCCCCCC) >> 2) | ((word & 0x3333333333333333) << 2);
+        word = ((word & 0xAAAAAAAAAAAAAAAA) >> 1) | ((word & 0x5555555555555555) << 1);
+        std::memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < n; i++) {
+        data[i] = BitManip::reverse8(data[i]);
+    }
+}
+
+static inline std::uint16_t swapBytes(std::uint16_t value)
+{
+    return BitManip::byteswap16(value);
+}
+
+static inline std::uint32_t swapBytes(std::uint32_t value)
+{
+    return BitManip::byteswap32(value);
+}
+
+static inline std::uint64_t swapBytes(std::uint64_t value)
+{
+    return BitManip::byteswap64(value);
+}
+
+template <class T>
+static void byteswapScalar(T *data, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        data[i] = swapBytes(data[i]);
+    }
+}
+
+#ifdef BITUTIL_X86_64
+
+__attribute__((target("popcnt")))
+static size_t popcountPopcnt(const std::uint64_t *words, size_t n)
+{
+    // Separate sums keep the popcnt instructions independent of each other
+    std::uint64_t a = 0, b = 0, c = 0, d = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        a += _mm_popcnt_u64(words[i]);
+        b += _mm_popcnt_u64(words[i + 1]);
+        c += _mm_popcnt_u64(words[i + 2]);
+        d += _mm_popcnt_u64(words[i + 3]);
+    }
+    for (; i < n; i++) {
+        a += _mm_popcnt_u64(words[i]);
+    }
+    return a + b + c + d;
+}
+
+/*
+Per 64-bit lane population count: each nibble is looked up in a 16 entry table, then the
+byte counts are summed against zero
+*/
+__attribute__((target("avx2")))
+static inline __m256i popcount256(__m256i v)
+{
+    const __m256i table = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i low = _mm256_and_si256(v, nibble);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(table, low), _mm256_shuffle_epi8(table, high));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline void csa256(__m256i& high, __m256i& low, __m256i a, __m256i b, __m256i c)
+{
+    __m256i u = _mm256_xor_si256(a, b);
+    high = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    low = _mm256_xor_si256(u, c);
+}
+
+/*
+Harley-Seal over 256-bit vectors, with the nibble lookup as the population count
+*/
+__attribute__((target("avx2,popcnt")))
+static size_t popcountAvx2(const std::uint64_t *words, size_t n)
+{
+    const __m256i *v = reinterpret_cast<const __m256i*>(words);
+    size_t vectors = n / 4;
+    __m256i ones = _mm256_setzero_si256();
+    __m256i twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256();
+    __m256i eights = _mm256_setzero_si256();
+    __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + HARLEY_SEAL_BLOCK <= vectors; i += HARLEY_SEAL_BLOCK) {
+        const __m256i *w = v + i;
+        csa256(twosA, ones, ones, _mm256_loadu_si256(w), _mm256_loadu_si256(w + 1));
+        csa256(twosB, ones, ones, _mm256_loadu_si256(w + 2), _mm256_loadu_si256(w + 3));
+        csa256(foursA, twos, twos, twosA, twosB);
+        csa256(twosA, ones, ones, _mm256_loadu_si256(w + 4), _mm256_loadu_si256(w + 5));
+        csa256(twosB, ones, ones, _mm256_loadu_si256(w + 6), _mm256_loadu_si256(w + 7));
+        csa256(foursB, twos, twos, twosA, twosB);
+        csa256(eightsA, fours, fours, foursA, foursB);
+        csa256(twosA, ones, ones, _mm256_loadu_si256(w + 8), _mm256_loadu_si256(w + 9));
+        csa256(twosB, ones, ones, _mm256_loadu_si256(w + 10), _mm256_loadu_si256(w + 11));
+        csa256(foursA, twos, twos, twosA, twosB);
+        csa256(twosA, ones, ones, _mm256_loadu_si256(w + 12), _mm256_loadu_si256(w + 13));
+        csa256(twosB, ones, ones, _mm256_loadu_si256(w + 14), _mm256_loadu_si256(w + 15));
+        csa256(foursB, twos, twos, twosA, twosB);
+        csa256(eightsB, fours, fours, foursA, foursB);
+        csa256(sixteens, eights, eights, eightsA, eightsB);
+        total = _mm256_add_epi64(total, popcount256(sixteens));
+    }
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(twos), 1));
+    total = _mm256_add_epi64(total, popcount256(ones));
+    for (; i < vectors; i++) {
+        total = _mm256_add_epi64(total, popcount256(_mm256_loadu_si256(v + i)));
+    }
+    size_t count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+        _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    for (i *= 4; i < n; i++) {
+        count += _mm_popcnt_u64(words[i]);
+    }
+    return count;
+}
+
+/*
+Shuffle control that reverses the bytes of each T sized element, repeated in both 128-bit lanes
+*/
+template <class T>
+static void byteswapShuffle(std::uint8_t control[32])
+{
+    for (size_t i = 0; i < 32; i++) {
+        control[i] = i - i % sizeof(T) + (sizeof(T) - 1 - i % sizeof(T));
+    }
+}
+
+/*
+Bits are reversed a nibble at a time: each nibble is looked up reversed, in the other half of its byte
+*/
+__attribute__((target("ssse3")))
+static void reverseBitsSsse3(std::uint8_t *data, size_t n)
+{
+    const __m128i toHigh = _mm_setr_epi8(
+        0x00, 0x80, 0x40, (char)0xC0, 0x20, (char)0xA0, 0x60, (char)0xE0,
+        0x10, (char)0x90, 0x50, (char)0xD0, 0x30, (char)0xB0, 0x70, (char)0xF0);
+    const __m128i toLow = _mm_setr_epi8(0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i *p = reinterpret_cast<__m128i*>(data + i);
+        __m128i v = _mm_loadu_si128(p);
+        __m128i low = _mm_shuffle_epi8(toHigh, _mm_and_si128(v, nibble));
+        __m128i high = _mm_shuffle_epi8(toLow, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        _mm_storeu_si128(p, _mm_or_si128(low, high));
+    }
+    reverseBitsScalar(data + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void reverseBitsAvx2(std::uint8_t *data, size_t n)
+{
+    const __m256i toHigh = _mm256_setr_epi8(
+        0x00, 0x80, 0x40, (char)0xC0, 0x20, (char)0xA0, 0x60, (char)0xE0,
+        0x10, (char)0x90, 0x50, (char)0xD0, 0x30, (char)0xB0, 0x70, (char)0xF0,
+        0x00, 0x80, 0x40, (char)0xC0, 0x20, (char)0xA0, 0x60, (char)0xE0,
+        0x10, (char)0x90, 0x50, (char)0xD0, 0x30, (char)0xB0, 0x70, (char)0xF0);
+    const __m256i toLow = _mm256_setr_epi8(
+        0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF,
+        0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i *p = reinterpret_cast<__m256i*>(data + i);
+        __m256i v = _mm256_loadu_si256(p);
+        __m256i low = _mm256_shuffle_epi8(toHigh, _mm256_and_si256(v, nibble));
+        __m256i high = _mm256_shuffle_epi8(toLow, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        _mm256_storeu_si256(p, _mm256_or_si256(low, high));
+    }
+    reverseBitsSsse3(data + i, n - i);
+}
+
+template <class T>
+__attribute__((target("ssse3")))
+static void byteswapSsse3(T *data, size_t n)
+{
+    std::uint8_t control[32];
+    byteswapShuffle<T>(control);
+    const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control));
+    const size_t step = 16 / sizeof(T);
+    size_t i = 0;
+    for (; i + step <= n; i += step) {
+        __m128i *p = reinterpret_cast<__m128i*>(data + i);
+        _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), shuffle));
+    }
+    byteswapScalar(data + i, n - i);
+}
+
+template <class T>
+__attribute__((target("avx2")))
+static void byteswapAvx2(T *data, size_t n)
+{
+    std::uint8_t control[32];
+    byteswapShuffle<T>(control);
+    const __m256i shuffle = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(control));
+    const size_t step = 32 / sizeof(T);
+    size_t i = 0;
+    for (; i + step <= n; i += step) {
+        __m256i *p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), shuffle));
+    }
+    byteswapSsse3(data + i, n - i);
+}
+
+#endif
+
+static PopcountKernel pickPopcountKernel()
+{
+#ifdef BITUTIL_X86_64
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return popcountAvx2;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return popcountPopcnt;
+    }
+#endif
+    return popcountScalar;
+}
+
+size_t BitManip::popcount(const std::uint64_t *words, size_t n)
+{
+    static const PopcountKernel kernel = pickPopcountKernel();
+    return kernel(words, n);
+}
+
+static SwapKernels pickSwapKernels()
+{
+#ifdef BITUTIL_X86_64
+    if (__builtin_cpu_supports("avx2")) {
+        return SwapKernels{reverseBitsAvx2, byteswapAvx2<std::uint16_t>, byteswapAvx2<std::uint32_t>, byteswapAvx2<std::uint64_t>};
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return SwapKernels{reverseBitsSsse3, byteswapSsse3<std::uint16_t>, byteswapSsse3<std::uint32_t>, byteswapSsse3<std::uint64_t>};
+    }
+#endif
+    return SwapKernels{reverseBitsScalar, byteswapScalar<std::uint16_t>, byteswapScalar<std::uint32_t>, byteswapScalar<std::uint64_t>};
+}
+
+static const SwapKernels& swapKernels()
+{
+    static const SwapKernels kernels = pickSwapKernels();
+    return kernels;
+}
+
+void BitManip::reverseBits(std::uint8_t *data, size_t n)
+{
+    swapKernels().reverseBits(data, n);
+}
+
+void BitManip::byteswap(std::uint16_t *data, size_t n)
+{
+    swapKernels().byteswap16(data, n);
+}
+
+void BitManip::byteswap(std::uint32_t *data, size_t n)
+{
+    swapKernels().byteswap32(data, n);
+}
+
+void BitManip::byteswap(std::uint64_t *data, size_t n)
+{
+    swapKernels().byteswap64(data, n);
+}
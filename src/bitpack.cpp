@@ -0,0 +1,398 @@
+/*
+bitpack.cpp
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "bitutil.hpp"
+
+#ifdef BITUTIL_X86_64
+#include <immintrin.h>
+#endif
+
+/*
+Kernels work on blocks of this many values, which take up exactly width bytes
+*/
+#define PACK_BLOCK 8
+
+/*
+Kernels may touch this many bytes past the start of their last block beyond the block itself,
+so those blocks are run through a padded copy instead
+*/
+#define PACK_SLACK 32
+
+/*
+Values unpacked at a time from a reversed copy of LSB first input
+*/
+#define PACK_CHUNK 1024
+
+static inline void storeBe32(std::uint8_t *dst, std::uint32_t word)
+{
+    dst[0] = word >> 24;
+    dst[1] = word >> 16;
+    dst[2] = word >> 8;
+    dst[3] = word;
+}
+
+typedef void (*PackKernel)(const std::uint32_t *in, size_t blocks, std::uint8_t *out);
+typedef void (*UnpackKernel)(const std::uint8_t *in, size_t blocks, std::uint32_t *out);
+
+template <unsigned W>
+static void packScalar(const std::uint32_t *in, size_t blocks, std::uint8_t *out)
+{
+    const std::uint64_t mask = (std::uint64_t{1} << W) - 1;
+    for (size_t block = 0; block < blocks; block++) {
+        // W is fixed, so the compiler knows at every step how many bits are waiting
+        std::uint64_t acc = 0;
+        unsigned bits = 0;
+        for (unsigned i = 0; i < PACK_BLOCK; i++) {
+            acc = (acc << W) | (in[i] & mask);
+            bits += W;
+            if (bits >= 32) {
+                bits -= 32;
+                storeBe32(out, acc >> bits);
+                out += 4;
+            }
+        }
+        for (; bits; bits -= 8) {
+            *out++ = acc >> (bits - 8);
+        }
+        in += PACK_BLOCK;
+    }
+}
+
+template <unsigned W>
+static void unpackScalar(const std::uint8_t *in, size_t blocks, std::uint32_t *out)
+{
+    for (size_t block = 0; block < blocks; block++) {
+        for (unsigned i = 0; i < PACK_BLOCK; i++) {
+            const unsigned bit = i * W;
+            out[i] = (BitBuffer::loadBe64(in + bit / 8) << (bit % 8)) >> (64 - W);
+        }
+        in += W;
+        out += PACK_BLOCK;
+    }
+}
+
+#ifdef BITUTIL_X86_64
+
+/*
+Each 128-bit lane packs 4 values: every value is shifted so its bits line up with the bytes it belongs in,
+then one shuffle per value moves those bytes into place. The upper lane's bytes start halfway into the block
+*/
+template <unsigned W>
+__attribute__((target("avx2")))
+static void packAvx2(const std::uint32_t *in, size_t blocks, std::uint8_t *out)
+{
+    if (W > 25) {
+        // A value and its offset within a byte no longer fit in 32 bits
+        packScalar<W>(in, blocks, out);
+        return;
+    }
+    const unsigned high = 4 * W / 8;
+    std::uint32_t shift[PACK_BLOCK];
+    std::uint8_t shuffle[4][32];
+    for (unsigned j = 0; j < PACK_BLOCK; j++) {
+        unsigned lane = j / 4;
+        unsigned rel = j * W - 8 * high * lane;
+        unsigned first = rel / 8;
+        shift[j] = 32 - W - rel % 8;
+        for (unsigned p = 0; p < 16; p++) {
+            bool inside = p >= first && p < first + 4;
+            shuffle[j % 4][lane * 16 + p] = inside ? (j % 4) * 4 + 3 - (p - first) : 0x80;
+        }
+    }
+    const __m256i mask = _mm256_set1_epi32(static_cast<std::uint32_t>((std::uint64_t{1} << W) - 1));
+    const __m256i shifts = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shift));
+    const __m256i shuffle0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shuffle[0]));
+    const __m256i shuffle1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shuffle[1]));
+    const __m256i shuffle2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shuffle[2]));
+    const __m256i shuffle3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shuffle[3]));
+    for (size_t block = 0; block < blocks; block++) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in)), mask);
+        v = _mm256_sllv_epi32(v, shifts);
+        __m256i bytes = _mm256_or_si256(
+            _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle0), _mm256_shuffle_epi8(v, shuffle1)),
+            _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle2), _mm256_shuffle_epi8(v, shuffle3)));
+        __m128i low = _mm256_castsi256_si128(bytes);
+        __m128i upper = _mm256_extracti128_si256(bytes, 1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_or_si128(low, _mm_slli_si128(upper, high)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16), _mm_srli_si128(upper, 16 - high));
+        in += PACK_BLOCK;
+        out += W;
+    }
+}
+
+/*
+Each value's bytes are shuffled into a lane in reverse, making a little-endian word whose top bits are the value
+after shifting out the bits of the value before it. Up to width 25 that fits 32-bit lanes, 8 values at once,
+wider values use 64-bit lanes, 4 at once
+*/
+template <unsigned W>
+__attribute__((target("avx2")))
+static void unpackAvx2(const std::uint8_t *in, size_t blocks, std::uint32_t *out)
+{
+    if (W <= 25) {
+        const unsigned high = 4 * W / 8;
+        std::uint8_t shuffle[32];
+        std::uint32_t shift[PACK_BLOCK];
+        for (unsigned j = 0; j < PACK_BLOCK; j++) {
+            unsigned lane = j / 4;
+            unsigned rel = j * W - 8 * high * lane;
+            for (unsigned k = 0; k < 4; k++) {
+                shuffle[lane * 16 + (j % 4) * 4 + k] = rel / 8 + 3 - k;
+            }
+            shift[j] = rel % 8;
+        }
+        const __m256i shuffleMask = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shuffle));
+        const __m256i shifts = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shift));
+        for (size_t block = 0; block < blocks; block++) {
+            __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+            __m128i upper = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + high));
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(low), upper, 1);
+            v = _mm256_shuffle_epi8(v, shuffleMask);
+            v = _mm256_srli_epi32(_mm256_sllv_epi32(v, shifts), 32 - W);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), v);
+            in += W;
+            out += PACK_BLOCK;
+        }
+        return;
+    }
+    unsigned base[2][2];
+    std::uint8_t shuffle[2][32];
+    std::uint64_t shift[2][4];
+    for (unsigned j = 0; j < PACK_BLOCK; j++) {
+        unsigned half = j / 4;
+        unsigned lane = j % 4 / 2;
+        base[half][lane] = (j & ~1u) * W / 8;
+        unsigned rel = j * W - 8 * base[half][lane];
+        for (unsigned k = 0; k < 8; k++) {
+            shuffle[half][lane * 16 + j % 2 * 8 + k] = rel / 8 + 7 - k;
+        }
+        shift[half][j % 4] = rel % 8;
+    }
+    const __m256i shuffle0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shuffle[0]));
+    const __m256i shuffle1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shuffle[1]));
+    const __m256i shifts0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shift[0]));
+    const __m256i shifts1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(shift[1]));
+    // Gathers the low half of each 64-bit lane into the bottom 128 bits
+    const __m256i gather = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    for (size_t block = 0; block < blocks; block++) {
+        __m256i v0 = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + base[0][0]))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + base[0][1])), 1);
+        __m256i v1 = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + base[1][0]))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + base[1][1])), 1);
+        v0 = _mm256_srli_epi64(_mm256_sllv_epi64(_mm256_shuffle_epi8(v0, shuffle0), shifts0), 64 - W);
+        v1 = _mm256_srli_epi64(_mm256_sllv_epi64(_mm256_shuffle_epi8(v1, shuffle1), shifts1), 64 - W);
+        v0 = _mm256_permutevar8x32_epi32(v0, gather);
+        v1 = _mm256_permutevar8x32_epi32(v1, gather);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permute2x128_si256(v0, v1, 0x20));
+        in += W;
+        out += PACK_BLOCK;
+    }
+}
+
+/*
+The same layout as packAvx2, one 128-bit half of the block at a time. SSE has no variable shifts,
+so each value is shifted by multiplying it by a power of two
+*/
+template <unsigned W>
+__attribute__((target("sse4.1")))
+static void packSse4(const std::uint32_t *in, size_t blocks, std::uint8_t *out)
+{
+    if (W > 25) {
+        packScalar<W>(in, blocks, out);
+        return;
+    }
+    const unsigned high = 4 * W / 8;
+    std::uint32_t multiplier[PACK_BLOCK];
+    std::uint8_t shuffle[4][32];
+    for (unsigned j = 0; j < PACK_BLOCK; j++) {
+        unsigned lane = j / 4;
+        unsigned rel = j * W - 8 * high * lane;
+        unsigned first = rel / 8;
+        multiplier[j] = std::uint32_t{1} << (32 - W - rel % 8);
+        for (unsigned p = 0; p < 16; p++) {
+            bool inside = p >= first && p < first + 4;
+            shuffle[j % 4][lane * 16 + p] = inside ? (j % 4) * 4 + 3 - (p - first) : 0x80;
+        }
+    }
+    const __m128i mask = _mm_set1_epi32(static_cast<std::uint32_t>((std::uint64_t{1} << W) - 1));
+    __m128i multipliers[2];
+    __m128i shuffles[2][4];
+    for (unsigned lane = 0; lane < 2; lane++) {
+        multipliers[lane] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(multiplier + lane * 4));
+        for (unsigned k = 0; k < 4; k++) {
+            shuffles[lane][k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(shuffle[k] + lane * 16));
+        }
+    }
+    for (size_t block = 0; block < blocks; block++) {
+        __m128i bytes[2];
+        for (unsigned lane = 0; lane < 2; lane++) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + lane * 4)), mask);
+            v = _mm_mullo_epi32(v, multipliers[lane]);
+            bytes[lane] = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(v, shuffles[lane][0]), _mm_shuffle_epi8(v, shuffles[lane][1])),
+                _mm_or_si128(_mm_shuffle_epi8(v, shuffles[lane][2]), _mm_shuffle_epi8(v, shuffles[lane][3])));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_or_si128(bytes[0], _mm_slli_si128(bytes[1], high)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16), _mm_srli_si128(bytes[1], 16 - high));
+        in += PACK_BLOCK;
+        out += W;
+    }
+}
+
+/*
+The 32-bit lane method of unpackAvx2, one 128-bit half of the block at a time.
+Wider values would need 64-bit variable shifts, which SSE lacks, so they are unpacked by the scalar kernel
+*/
+template <unsigned W>
+__attribute__((target("sse4.1")))
+static void unpackSse4(const std::uint8_t *in, size_t blocks, std::uint32_t *out)
+{
+    if (W > 25) {
+        unpackScalar<W>(in, blocks, out);
+        return;
+    }
+    const unsigned high = 4 * W / 8;
+    std::uint8_t shuffle[32];
+    std::uint32_t multiplier[PACK_BLOCK];
+    for (unsigned j = 0; j < PACK_BLOCK; j++) {
+        unsigned lane = j / 4;
+        unsigned rel = j * W - 8 * high * lane;
+        for (unsigned k = 0; k < 4; k++) {
+            shuffle[lane * 16 + (j % 4) * 4 + k] = rel / 8 + 3 - k;
+        }
+        multiplier[j] = std::uint32_t{1} << (rel % 8);
+    }
+    const __m128i shuffle0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(shuffle));
+    const __m128i shuffle1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(shuffle + 16));
+    const __m128i multipliers0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(multiplier));
+    const __m128i multipliers1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(multiplier + 4));
+    for (size_t block = 0; block < blocks; block++) {
+        __m128i low = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)), shuffle0);
+        __m128i upper = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + high)), shuffle1);
+        low = _mm_srli_epi32(_mm_mullo_epi32(low, multipliers0), 32 - W);
+        upper = _mm_srli_epi32(_mm_mullo_epi32(upper, multipliers1), 32 - W);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), low);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4), upper);
+        in += W;
+        out += PACK_BLOCK;
+    }
+}
+
+#endif
+
+#define PACK_WIDTHS(kernel) \
+    kernel<1>, kernel<2>, kernel<3>, kernel<4>, kernel<5>, kernel<6>, kernel<7>, kernel<8>, \
+    kernel<9>, kernel<10>, kernel<11>, kernel<12>, kernel<13>, kernel<14>, kernel<15>, kernel<16>, \
+    kernel<17>, kernel<18>, kernel<19>, kernel<20>, kernel<21>, kernel<22>, kernel<23>, kernel<24>, \
+    kernel<25>, kernel<26>, kernel<27>, kernel<28>, kernel<29>, kernel<30>, kernel<31>, kernel<32>
+
+/*
+Kernels for each width, indexed by width
+*/
+struct PackKernels {
+    PackKernel pack[33];
+    UnpackKernel unpack[33];
+};
+
+static PackKernels pickPackKernels()
+{
+#ifdef BITUTIL_X86_64
+    if (__builtin_cpu_supports("avx2")) {
+        return PackKernels{{nullptr, PACK_WIDTHS(packAvx2)}, {nullptr, PACK_WIDTHS(unpackAvx2)}};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return PackKernels{{nullptr, PACK_WIDTHS(packSse4)}, {nullptr, PACK_WIDTHS(unpackSse4)}};
+    }
+#endif
+    return PackKernels{{nullptr, PACK_WIDTHS(packScalar)}, {nullptr, PACK_WIDTHS(unpackScalar)}};
+}
+
+static const PackKernels& packKernels()
+{
+    static const PackKernels kernels = pickPackKernels();
+    return kernels;
+}
+
+/*
+Number of leading blocks a kernel can run on directly, leaving it PACK_SLACK bytes past each one
+*/
+static inline size_t directBlocks(size_t n, unsigned width, size_t bytes)
+{
+    if (bytes < PACK_SLACK + width) {
+        return 0;
+    }
+    return std::min(n / PACK_BLOCK, (bytes - PACK_SLACK) / width);
+}
+
+static void unpackMsb(const std::uint8_t *in, size_t n, unsigned width, std::uint32_t *out)
+{
+    UnpackKernel kernel = packKernels().unpack[width];
+    size_t bytes = (n * width + 7) / 8;
+    size_t block = directBlocks(n, width, bytes);
+    kernel(in, block, out);
+    for (; block * PACK_BLOCK < n; block++) {
+        std::uint8_t packed[PACK_SLACK * 2] = {0};
+        std::uint32_t values[PACK_BLOCK];
+        std::memcpy(packed, in + block * width, std::min<size_t>(width, bytes - block * width));
+        kernel(packed, 1, values);
+        std::memcpy(out + block * PACK_BLOCK, values, std::min<size_t>(PACK_BLOCK, n - block * PACK_BLOCK) * sizeof(std::uint32_t));
+    }
+}
+
+size_t BitManip::pack(const std::uint32_t *in, size_t n, unsigned width, std::uint8_t *out, BitBuffer::BitOrder order)
+{
+    if (width > 32) {
+        throw BitBuffer::BitBufferException("bit count too high");
+    }
+    if (width == 0) {
+        return 0;
+    }
+    PackKernel kernel = packKernels().pack[width];
+    size_t bytes = (n * width + 7) / 8;
+    size_t block = directBlocks(n, width, bytes);
+    kernel(in, block, out);
+    for (; block * PACK_BLOCK < n; block++) {
+        // Missing values of the last block are 0, which pads it with 0-bits
+        std::uint32_t values[PACK_BLOCK] = {0};
+        std::uint8_t packed[PACK_SLACK * 2];
+        std::memcpy(values, in + block * PACK_BLOCK, std::min<size_t>(PACK_BLOCK, n - block * PACK_BLOCK) * sizeof(std::uint32_t));
+        kernel(values, 1, packed);
+        std::memcpy(out + block * width, packed, std::min<size_t>(width, bytes - block * width));
+    }
+    // LSB first layouts are the MSB first layout with the bits of each byte reversed
+    if (order == BitBuffer::LSB) {
+        BitManip::reverseBits(out, bytes);
+    }
+    return bytes;
+}
+
+size_t BitManip::unpack(const std::uint8_t *in, size_t n, unsigned width, std::uint32_t *out, BitBuffer::BitOrder order)
+{
+    if (width > 32) {
+        throw BitBuffer::BitBufferException("bit count too high");
+    }
+    if (width == 0) {
+        std::fill(out, out + n, 0);
+        return 0;
+    }
+    size_t bytes = (n * width + 7) / 8;
+    if (order == BitBuffer::MSB) {
+        unpackMsb(in, n, width, out);
+        return bytes;
+    }
+    std::uint8_t chunk[PACK_CHUNK * 4];
+    for (size_t done = 0; done < n; done += PACK_CHUNK) {
+        size_t count = std::min<size_t>(PACK_CHUNK, n - done);
+        size_t chunkBytes = (count * width + 7) / 8;
+        std::memcpy(chunk, in + done / PACK_BLOCK * width, chunkBytes);
+        BitManip::reverseBits(chunk, chunkBytes);
+        unpackMsb(chunk, count, width, out + done);
+    }
+    return bytes;
+}
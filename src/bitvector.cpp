@@ -0,0 +1,180 @@
+/*
+bitvector.cpp
+*/
+
+#include <cstdint>
+#include <algorithm>
+#include "bitutil.hpp"
+
+/*
+Bits per block. Each block has one word of counts: the 1-bits before it in the low 32 bits,
+then the 1-bits of each of its first three sub-blocks in 10 bits apiece
+*/
+#define VECTOR_BLOCK 2048
+
+/*
+Bits per sub-block, whose counts are kept in the block's word
+*/
+#define VECTOR_SUB_BLOCK 512
+
+/*
+Block counts are relative to the start of a span of this many bits, whose own count is kept whole
+*/
+#define VECTOR_UPPER_SHIFT 32
+
+/*
+The block holding every this many'th 1-bit is kept, narrowing the search for select
+*/
+#define VECTOR_SAMPLE 8192
+
+#define WORDS_PER_BLOCK (VECTOR_BLOCK / 64)
+#define WORDS_PER_SUB_BLOCK (VECTOR_SUB_BLOCK / 64)
+
+static inline size_t subBlockCount(std::uint64_t entry, size_t sub)
+{
+    return (entry >> (32 + 10 * sub)) & 0x3FF;
+}
+
+/*
+Broadword select: the running 1-bit counts of the bytes are compared against rank all at once
+to find the byte holding the bit, and only that byte is searched bit by bit
+*/
+static inline size_t selectInWord(std::uint64_t word, size_t rank)
+{
+    const std::uint64_t ones = 0x0101010101010101;
+    const std::uint64_t highs = 0x8080808080808080;
+    std::uint64_t counts = word - ((word >> 1) & 0x5555555555555555);
+    counts = (counts & 0x3333333333333333) + ((counts >> 2) & 0x3333333333333333);
+    counts = (counts + (counts >> 4)) & 0x0F0F0F0F0F0F0F0F;
+    // Byte j is the number of 1-bits in bytes 0 through j, at most 64 so no byte borrows below
+    std::uint64_t sums = counts * ones;
+    // The high bit of byte j is set when the sum through byte j is at most rank, which is true of
+    // every byte before the one holding the bit
+    std::uint64_t before = ((rank * ones) | highs) - sums;
+    size_t place = (((before & highs) >> 7) * ones >> 56) * 8;
+    rank -= ((sums << 8) >> place) & 0xFF;
+    std::uint64_t byte = (word >> place) & 0xFF;
+    for (; rank; rank--) {
+        byte &= byte - 1;
+    }
+    return place + BitManip::trailingZeros64(byte);
+}
+
+BitManip::BitVector::BitVector(const std::uint64_t *words, size_t bits) :
+    words(words, words + (bits + 63) / 64), length{bits}
+{
+    build();
+}
+
+BitManip::BitVector::BitVector(const std::uint8_t *data, size_t bits, BitBuffer::BitOrder order) :
+    words((bits + 63) / 64), length{bits}
+{
+    size_t bytes = (bits + 7) / 8;
+    for (size_t i = 0; i < bytes; i++) {
+        words[i / 8] |= std::uint64_t{data[i]} << (i % 8 * 8);
+    }
+    // MSB first puts the first bit of each byte at its top
+    if (order == BitBuffer::MSB) {
+        reverseBits(reinterpret_cast<std::uint8_t*>(words.data()), bytes);
+    }
+    build();
+}
+
+void BitManip::BitVector::build()
+{
+    if (length % 64) {
+        words.back() &= (std::uint64_t{1} << (length % 64)) - 1;
+    }
+    // A block past the last full one answers rank(size())
+    size_t blockCount = length / VECTOR_BLOCK + 1;
+    blocks.assign(blockCount, 0);
+    upper.assign((length >> VECTOR_UPPER_SHIFT) + 1, 0);
+    samples.clear();
+    size_t total = 0;
+    for (size_t block = 0; block < blockCount; block++) {
+        size_t span = (block * VECTOR_BLOCK) >> VECTOR_UPPER_SHIFT;
+        if (((block * VECTOR_BLOCK) & ((std::uint64_t{1} << VECTOR_UPPER_SHIFT) - 1)) == 0) {
+            upper[span] = total;
+        }
+        std::uint64_t entry = total - upper[span];
+        for (size_t sub = 0; sub < VECTOR_BLOCK / VECTOR_SUB_BLOCK; sub++) {
+            size_t first = block * WORDS_PER_BLOCK + sub * WORDS_PER_SUB_BLOCK;
+            size_t count = 0;
+            if (first < words.size()) {
+                count = popcount(words.data() + first, std::min<size_t>(WORDS_PER_SUB_BLOCK, words.size() - first));
+            }
+            if (sub < VECTOR_BLOCK / VECTOR_SUB_BLOCK - 1) {
+                entry |= std::uint64_t{count} << (32 + 10 * sub);
+            }
+            total += count;
+        }
+        blocks[block] = entry;
+        while (samples.size() * VECTOR_SAMPLE < total) {
+            samples.push_back(block);
+        }
+    }
+    ones = total;
+}
+
+size_t BitManip::BitVector::blockRank(size_t block) const
+{
+    return upper[(block * VECTOR_BLOCK) >> VECTOR_UPPER_SHIFT] + (blocks[block] & 0xFFFFFFFF);
+}
+
+size_t BitManip::BitVector::rank1(size_t i) const
+{
+    size_t block = i / VECTOR_BLOCK;
+    std::uint64_t entry = blocks[block];
+    size_t rank = upper[i >> VECTOR_UPPER_SHIFT] + (entry & 0xFFFFFFFF);
+    size_t sub = i % VECTOR_BLOCK / VECTOR_SUB_BLOCK;
+    for (size_t s = 0; s < sub; s++) {
+        rank += subBlockCount(entry, s);
+    }
+    size_t last = i / 64;
+    for (size_t word = block * WORDS_PER_BLOCK + sub * WORDS_PER_SUB_BLOCK; word < last; word++) {
+        rank += bitsSet64(words[word]);
+    }
+    if (i % 64) {
+        rank += bitsSet64(words[last] & ((std::uint64_t{1} << (i % 64)) - 1));
+    }
+    return rank;
+}
+
+size_t BitManip::BitVector::select1(size_t k) const
+{
+    if (k >= ones) {
+        return length;
+    }
+    // The bit lies between the blocks of the samples either side of it
+    size_t sample = k / VECTOR_SAMPLE;
+    size_t low = samples[sample];
+    size_t high = sample + 1 < samples.size() ? samples[sample + 1] + 1 : blocks.size();
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (blockRank(mid) <= k) {
+            low = mid;
+        }
+        else {
+            high = mid;
+        }
+    }
+    k -= blockRank(low);
+    std::uint64_t entry = blocks[low];
+    size_t word = low * WORDS_PER_BLOCK;
+    for (size_t sub = 0; sub < VECTOR_BLOCK / VECTOR_SUB_BLOCK - 1; sub++) {
+        size_t count = subBlockCount(entry, sub);
+        if (k < count) {
+            break;
+        }
+        k -= count;
+        word += WORDS_PER_SUB_BLOCK;
+    }
+    for (;; word++) {
+        size_t count = bitsSet64(words[word]);
+        if (k < count) {
+            break;
+        }
+        k -= count;
+    }
+    return word * 64 + selectInWord(words[word], k);
+}
@@ -6,9 +6,19 @@ crc.cpp
 #include <iomanip>
 
 #include <cstdint>
+#include <cstring>
 #include "bitutil.hpp"
 
+#ifdef BITUTIL_X86_64
+#include <immintrin.h>
+#endif
+
+#define CRC32_POLY 0xEDB88320
+#define CRC32C_POLY 0x82F63B78
+
 #define CRC_TABLE_SIZE 256
+#define CRC_SLICES 8
+#define CRC_FOLD_MIN 128
 
 /* Precomputed, screw it */
 static const std::uint8_t crc8_table[CRC_TABLE_SIZE] = {
@@ -59,24 +69,428 @@ static const std::uint16_t crc16_table[CRC_TABLE_SIZE] = {
    540, 33305,   520, 33293, 33287,   514
 };
 
+/*
+Tables for slicing-by-8: slice k holds the CRC of each byte followed by k zero bytes
+*/
+struct Crc8Slices {
+    std::uint8_t table[CRC_SLICES][CRC_TABLE_SIZE];
+    Crc8Slices()
+    {
+        for (size_t b = 0; b < CRC_TABLE_SIZE; b++) {
+            table[0][b] = crc8_table[b];
+            for (size_t k = 1; k < CRC_SLICES; k++) {
+                table[k][b] = crc8_table[table[k - 1][b]];
+            }
+        }
+    }
+};
+
+struct Crc16Slices {
+    std::uint16_t table[CRC_SLICES][CRC_TABLE_SIZE];
+    Crc16Slices()
+    {
+        for (size_t b = 0; b < CRC_TABLE_SIZE; b++) {
+            table[0][b] = crc16_table[b];
+            for (size_t k = 1; k < CRC_SLICES; k++) {
+                std::uint16_t prev = table[k - 1][b];
+                table[k][b] = (prev << 8) ^ crc16_table[prev >> 8];
+            }
+        }
+    }
+};
+
+/*
+Slicing-by-8 tables for a reflected (LSB-first) 32-bit polynomial
+*/
+struct Crc32Slices {
+    std::uint32_t table[CRC_SLICES][CRC_TABLE_SIZE];
+    Crc32Slices(std::uint32_t poly)
+    {
+        for (std::uint32_t b = 0; b < CRC_TABLE_SIZE; b++) {
+            std::uint32_t crc = b;
+            for (size_t bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (poly & -(crc & 1));
+            }
+            table[0][b] = crc;
+        }
+        for (size_t b = 0; b < CRC_TABLE_SIZE; b++) {
+            for (size_t k = 1; k < CRC_SLICES; k++) {
+                std::uint32_t prev = table[k - 1][b];
+                table[k][b] = (prev >> 8) ^ table[0][prev & 0xff];
+            }
+        }
+    }
+};
+
+static std::uint8_t crc8_sliced(const std::uint8_t *data, size_t n, std::uint8_t crc)
+{
+    static const Crc8Slices slices;
+    const std::uint8_t (*t)[CRC_TABLE_SIZE] = slices.table;
+    for (; n >= CRC_SLICES; n -= CRC_SLICES, data += CRC_SLICES) {
+        crc = t[7][data[0] ^ crc] ^ t[6][data[1]] ^ t[5][data[2]] ^ t[4][data[3]] ^
+            t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for (size_t i = 0; i < n; i++) {
+        crc = t[0][data[i] ^ crc];
+    }
+    return crc;
+}
+
+static std::uint16_t crc16_sliced(const std::uint8_t *data, size_t n, std::uint16_t crc)
+{
+    static const Crc16Slices slices;
+    const std::uint16_t (*t)[CRC_TABLE_SIZE] = slices.table;
+    for (; n >= CRC_SLICES; n -= CRC_SLICES, data += CRC_SLICES) {
+        crc = t[7][data[0] ^ (crc >> 8)] ^ t[6][data[1] ^ (crc & 0xff)] ^ t[5][data[2]] ^ t[4][data[3]] ^
+            t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for (size_t i = 0; i < n; i++) {
+        crc = (crc << 8) ^ t[0][(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+/*
+Update a raw reflected CRC32 register, without the pre- and post-inversion
+*/
+static std::uint32_t crc32_sliced(const std::uint8_t *data, size_t n, std::uint32_t crc, const Crc32Slices& slices)
+{
+    const std::uint32_t (*t)[CRC_TABLE_SIZE] = slices.table;
+    for (; n >= CRC_SLICES; n -= CRC_SLICES, data += CRC_SLICES) {
+        crc = t[7][(crc ^ data[0]) & 0xff] ^ t[6][((crc >> 8) ^ data[1]) & 0xff] ^
+            t[5][((crc >> 16) ^ data[2]) & 0xff] ^ t[4][(crc >> 24) ^ data[3]] ^
+            t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for (size_t i = 0; i < n; i++) {
+        crc = (crc >> 8) ^ t[0][(crc ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+static const Crc32Slices& crc32Slices()
+{
+    static const Crc32Slices slices(CRC32_POLY);
+    return slices;
+}
+
+static const Crc32Slices& crc32cSlices()
+{
+    static const Crc32Slices slices(CRC32C_POLY);
+    return slices;
+}
+
+#ifdef BITUTIL_X86_64
+
+/*
+Multipliers for carry-less folding. Folding replaces a 128-bit block by a shorter polynomial
+congruent to it modulo the CRC polynomial, so the folded 16 bytes have the same CRC as the data
+*/
+struct CrcFoldKeys {
+    __m128i by4;
+    __m128i by1;
+};
+
+/*
+x^n modulo the MSB-first polynomial x^width + poly
+*/
+static std::uint64_t xPowModMsb(size_t n, std::uint64_t poly, size_t width)
+{
+    std::uint64_t rem = 1;
+    for (size_t i = 0; i < n; i++) {
+        bool carry = (rem >> (width - 1)) & 1;
+        rem = (rem << 1) & ((std::uint64_t{2} << (width - 1)) - 1);
+        if (carry) {
+            rem ^= poly;
+        }
+    }
+    return rem;
+}
+
+static CrcFoldKeys msbFoldKeys(std::uint64_t poly, size_t width)
+{
+    CrcFoldKeys keys;
+    keys.by4 = _mm_set_epi64x(xPowModMsb(512 + 64, poly, width), xPowModMsb(512, poly, width));
+    keys.by1 = _mm_set_epi64x(xPowModMsb(128 + 64, poly, width), xPowModMsb(128, poly, width));
+    return keys;
+}
+
+/*
+x^n modulo a reflected 32-bit polynomial, as a reflected 64-bit multiplier.
+The product of two reflected values comes out one bit short, so it is x^(n-1) that is reflected
+*/
+static std::uint64_t xPowModLsb(size_t n, std::uint32_t poly)
+{
+    std::uint32_t rem = 0x80000000;
+    for (size_t i = 1; i < n; i++) {
+        rem = (rem >> 1) ^ (poly & -(rem & 1));
+    }
+    return std::uint64_t{rem} << 32;
+}
+
+static CrcFoldKeys lsbFoldKeys(std::uint32_t poly)
+{
+    CrcFoldKeys keys;
+    keys.by4 = _mm_set_epi64x(xPowModLsb(512, poly), xPowModLsb(512 + 64, poly));
+    keys.by1 = _mm_set_epi64x(xPowModLsb(128, poly), xPowModLsb(128 + 64, poly));
+    return keys;
+}
+
+static bool hasPclmul()
+{
+    static const bool supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+    return supported;
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i foldBlock(__m128i block, __m128i keys)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(block, keys, 0x11), _mm_clmulepi64_si128(block, keys, 0x00));
+}
+
+/*
+Fold an MSB-first CRC over whole 16-byte blocks of data, at least 64 bytes
+
+start: The running CRC, which is merged into the first bytes
+width: Width of the CRC in bits
+folded out: 16 bytes whose CRC from 0 equals the CRC of the folded data
+returns the number of bytes folded
+*/
+__attribute__((target("pclmul,ssse3")))
+static size_t foldMsb(const std::uint8_t *data, size_t n, std::uint64_t start, size_t width,
+    const CrcFoldKeys& keys, std::uint8_t *folded)
+{
+    const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const std::uint8_t *end = data + (n & ~size_t{15});
+    __m128i x0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), swap);
+    __m128i x1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)), swap);
+    __m128i x2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)), swap);
+    __m128i x3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)), swap);
+    x0 = _mm_xor_si128(x0, _mm_set_epi64x(start << (64 - width), 0));
+    data += 64;
+    for (; end - data >= 64; data += 64) {
+        x0 = _mm_xor_si128(foldBlock(x0, keys.by4),
+            _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), swap));
+        x1 = _mm_xor_si128(foldBlock(x1, keys.by4),
+            _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)), swap));
+        x2 = _mm_xor_si128(foldBlock(x2, keys.by4),
+            _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)), swap));
+        x3 = _mm_xor_si128(foldBlock(x3, keys.by4),
+            _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)), swap));
+    }
+    x1 = _mm_xor_si128(x1, foldBlock(x0, keys.by1));
+    x2 = _mm_xor_si128(x2, foldBlock(x1, keys.by1));
+    x3 = _mm_xor_si128(x3, foldBlock(x2, keys.by1));
+    for (; data != end; data += 16) {
+        x3 = _mm_xor_si128(foldBlock(x3, keys.by1),
+            _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), swap));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(folded), _mm_shuffle_epi8(x3, swap));
+    return n & ~size_t{15};
+}
+
+/*
+Fold a reflected 32-bit CRC over whole 16-byte blocks of data, at least 64 bytes
+
+crc: The raw CRC register, which is merged into the first bytes
+folded out: 16 bytes whose raw CRC from 0 equals the raw CRC of the folded data
+returns the number of bytes folded
+*/
+__attribute__((target("pclmul,ssse3")))
+static size_t foldLsb(const std::uint8_t *data, size_t n, std::uint32_t crc, const CrcFoldKeys& keys, std::uint8_t *folded)
+{
+    const std::uint8_t *end = data + (n & ~size_t{15});
+    __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+    __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32));
+    __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+    data += 64;
+    for (; end - data >= 64; data += 64) {
+        x0 = _mm_xor_si128(foldBlock(x0, keys.by4), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+        x1 = _mm_xor_si128(foldBlock(x1, keys.by4), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)));
+        x2 = _mm_xor_si128(foldBlock(x2, keys.by4), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)));
+        x3 = _mm_xor_si128(foldBlock(x3, keys.by4), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)));
+    }
+    x1 = _mm_xor_si128(x1, foldBlock(x0, keys.by1));
+    x2 = _mm_xor_si128(x2, foldBlock(x1, keys.by1));
+    x3 = _mm_xor_si128(x3, foldBlock(x2, keys.by1));
+    for (; data != end; data += 16) {
+        x3 = _mm_xor_si128(foldBlock(x3, keys.by1), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(folded), x3);
+    return n & ~size_t{15};
+}
+
+static bool hasSse42()
+{
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+
+/*
+Update a raw CRC32C register with the SSE4.2 crc32 instruction
+*/
+__attribute__((target("sse4.2")))
+static std::uint32_t crc32c_hardware(const std::uint8_t *data, size_t n, std::uint32_t crc)
+{
+    std::uint64_t crc64 = crc;
+    for (; n >= sizeof(std::uint64_t); n -= sizeof(std::uint64_t), data += sizeof(std::uint64_t)) {
+        std::uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (size_t i = 0; i < n; i++) {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+    return crc;
+}
+
+#endif
+
+/*
+Product of two polynomials modulo the MSB-first polynomial x^width + poly
+*/
+static std::uint64_t mulModMsb(std::uint64_t a, std::uint64_t b, std::uint64_t poly, size_t width)
+{
+    std::uint64_t product = 0;
+    for (size_t i = width; i-- > 0;) {
+        bool carry = (product >> (width - 1)) & 1;
+        product = (product << 1) & ((std::uint64_t{2} << (width - 1)) - 1);
+        if (carry) {
+            product ^= poly;
+        }
+        if ((b >> i) & 1) {
+            product ^= a;
+        }
+    }
+    return product;
+}
+
+/*
+x^(8 * bytes) modulo an MSB-first polynomial, by repeated squaring
+*/
+static std::uint64_t bytePowModMsb(size_t bytes, std::uint64_t poly, size_t width)
+{
+    std::uint64_t result = 1;
+    std::uint64_t square = mulModMsb(1 << 4, 1 << 4, poly, width);
+    for (; bytes; bytes >>= 1) {
+        if (bytes & 1) {
+            result = mulModMsb(result, square, poly, width);
+        }
+        square = mulModMsb(square, square, poly, width);
+    }
+    return result;
+}
+
+/*
+Product of two polynomials modulo a reflected 32-bit polynomial, where x^0 is the top bit
+*/
+static std::uint32_t mulModLsb(std::uint32_t a, std::uint32_t b, std::uint32_t poly)
+{
+    std::uint32_t product = 0;
+    for (std::uint32_t bit = 0x80000000; bit; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = (b >> 1) ^ (poly & -(b & 1));
+    }
+    return product;
+}
+
+/*
+x^(8 * bytes) modulo a reflected 32-bit polynomial, by repeated squaring
+*/
+static std::uint32_t bytePowModLsb(size_t bytes, std::uint32_t poly)
+{
+    std::uint32_t result = 0x80000000;
+    std::uint32_t square = 0x80000000 >> 8;
+    for (; bytes; bytes >>= 1) {
+        if (bytes & 1) {
+            result = mulModLsb(result, square, poly);
+        }
+        square = mulModLsb(square, square, poly);
+    }
+    return result;
+}
+
 namespace Digest {
 
     std::uint8_t crc8_base(const std::uint8_t *data, size_t n, std::uint8_t crc)
     {
-        for (size_t i = 0; i < n; i++) {
-            size_t lookup = data[i] ^ crc;
-            crc = crc8_table[lookup];
+#ifdef BITUTIL_X86_64
+        if (n >= CRC_FOLD_MIN && hasPclmul()) {
+            static const CrcFoldKeys keys = msbFoldKeys(0x07, 8);
+            std::uint8_t folded[16];
+            size_t done = foldMsb(data, n, crc, 8, keys, folded);
+            crc = crc8_sliced(folded, sizeof(folded), 0);
+            data += done;
+            n -= done;
         }
-        return crc;
+#endif
+        return crc8_sliced(data, n, crc);
     }
 
     std::uint16_t crc16_base(const std::uint8_t *data, size_t n, std::uint16_t crc)
     {
-        for (size_t i = 0; i < n; i++) {
-            size_t lookup = (crc >> 8) ^ data[i];
-            crc = (crc << 8) ^ crc16_table[lookup & 0xff];
+#ifdef BITUTIL_X86_64
+        if (n >= CRC_FOLD_MIN && hasPclmul()) {
+            static const CrcFoldKeys keys = msbFoldKeys(0x8005, 16);
+            std::uint8_t folded[16];
+            size_t done = foldMsb(data, n, crc, 16, keys, folded);
+            crc = crc16_sliced(folded, sizeof(folded), 0);
+            data += done;
+            n -= done;
+        }
+#endif
+        return crc16_sliced(data, n, crc);
+    }
+
+    std::uint32_t crc32_base(const std::uint8_t *data, size_t n, std::uint32_t crc)
+    {
+        crc = ~crc;
+#ifdef BITUTIL_X86_64
+        if (n >= CRC_FOLD_MIN && hasPclmul()) {
+            static const CrcFoldKeys keys = lsbFoldKeys(CRC32_POLY);
+            std::uint8_t folded[16];
+            size_t done = foldLsb(data, n, crc, keys, folded);
+            crc = crc32_sliced(folded, sizeof(folded), 0, crc32Slices());
+            data += done;
+            n -= done;
         }
-        return crc;
+#endif
+        return ~crc32_sliced(data, n, crc, crc32Slices());
+    }
+
+    std::uint32_t crc32c_base(const std::uint8_t *data, size_t n, std::uint32_t crc)
+    {
+        crc = ~crc;
+#ifdef BITUTIL_X86_64
+        if (hasSse42()) {
+            return ~crc32c_hardware(data, n, crc);
+        }
+#endif
+        return ~crc32_sliced(data, n, crc, crc32cSlices());
+    }
+
+    std::uint8_t crc8_combine(std::uint8_t crcA, std::uint8_t crcB, size_t lengthB)
+    {
+        return mulModMsb(crcA, bytePowModMsb(lengthB, 0x07, 8), 0x07, 8) ^ crcB;
+    }
+
+    std::uint16_t crc16_combine(std::uint16_t crcA, std::uint16_t crcB, size_t lengthB)
+    {
+        return mulModMsb(crcA, bytePowModMsb(lengthB, 0x8005, 16), 0x8005, 16) ^ crcB;
+    }
+
+    std::uint32_t crc32_combine(std::uint32_t crcA, std::uint32_t crcB, size_t lengthB)
+    {
+        return mulModLsb(crcA, bytePowModLsb(lengthB, CRC32_POLY), CRC32_POLY) ^ crcB;
+    }
+
+    std::uint32_t crc32c_combine(std::uint32_t crcA, std::uint32_t crcB, size_t lengthB)
+    {
+        return mulModLsb(crcA, bytePowModLsb(lengthB, CRC32C_POLY), CRC32C_POLY) ^ crcB;
     }
 
 }
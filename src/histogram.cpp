@@ -0,0 +1,97 @@
+/*
+histogram.cpp
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include "bitutil.hpp"
+
+/*
+Number of histograms counted side by side, so that runs of one byte value
+increment different counters rather than waiting on the last increment of the same one
+*/
+#define HISTOGRAM_TABLES 4
+
+/*
+Fewest bytes worth handing to another thread
+*/
+#define HISTOGRAM_THREAD_MIN (1 << 20)
+
+static inline std::uint64_t load64(const std::uint8_t *data)
+{
+    std::uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+/*
+Add the bytes of a little-endian word, two to each table
+*/
+static inline void countWord(std::uint32_t tables[HISTOGRAM_TABLES][256], std::uint64_t word)
+{
+    tables[0][word & 0xFF]++;
+    tables[1][(word >> 8) & 0xFF]++;
+    tables[2][(word >> 16) & 0xFF]++;
+    tables[3][(word >> 24) & 0xFF]++;
+    tables[0][(word >> 32) & 0xFF]++;
+    tables[1][(word >> 40) & 0xFF]++;
+    tables[2][(word >> 48) & 0xFF]++;
+    tables[3][word >> 56]++;
+}
+
+void Huffman::histogram(const std::uint8_t *data, size_t n, std::uint32_t histogram[256])
+{
+    std::uint32_t tables[HISTOGRAM_TABLES][256] = {};
+    size_t i = 0;
+    // The next words are loaded while the current ones are counted
+    if (n >= 32) {
+        std::uint64_t a = load64(data), b = load64(data + 8);
+        for (; i + 32 <= n; i += 16) {
+            std::uint64_t c = load64(data + i + 16), d = load64(data + i + 24);
+            countWord(tables, a);
+            countWord(tables, b);
+            a = c;
+            b = d;
+        }
+        countWord(tables, a);
+        countWord(tables, b);
+        i += 16;
+    }
+    for (; i < n; i++) {
+        tables[i % HISTOGRAM_TABLES][data[i]]++;
+    }
+    for (size_t value = 0; value < 256; value++) {
+        histogram[value] = tables[0][value] + tables[1][value] + tables[2][value] + tables[3][value];
+    }
+}
+
+void Huffman::histogram(const std::uint8_t *data, size_t n, std::uint32_t histogram[256], size_t threads)
+{
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    threads = std::min(threads, n / HISTOGRAM_THREAD_MIN);
+    if (threads <= 1) {
+        Huffman::histogram(data, n, histogram);
+        return;
+    }
+    // This thread counts the last piece, taking whatever does not divide evenly
+    size_t piece = n / threads;
+    std::vector<std::uint32_t> counts((threads - 1) * 256);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads - 1; t++) {
+        workers.emplace_back([=, &counts]() {
+            Huffman::histogram(data + t * piece, piece, &counts[t * 256]);
+        });
+    }
+    size_t start = (threads - 1) * piece;
+    Huffman::histogram(data + start, n - start, histogram);
+    for (size_t t = 0; t < threads - 1; t++) {
+        workers[t].join();
+        for (size_t value = 0; value < 256; value++) {
+            histogram[value] += counts[t * 256 + value];
+        }
+    }
+}
@@ -6,157 +6,398 @@ huffmancode.cpp
 #include <utility>
 #include <algorithm>
 #include <iostream>
-#include <queue>
 #include "bitutil.hpp"
 
-struct HuffmanNode {
-    int symbol;
-    int frequency;
-    int length;
-    std::pair<HuffmanNode*, HuffmanNode*> children;
-    HuffmanNode(int symbol, int frequency) :
-        symbol{symbol},
-        frequency{frequency},
-        length{0},
-        children{std::pair<HuffmanNode*, HuffmanNode*>(nullptr, nullptr)} {}
-    HuffmanNode(HuffmanNode *left, HuffmanNode *right) :
-        symbol{-1},
-        frequency{left->frequency + right->frequency},
-        length{0},
-        children{std::pair<HuffmanNode*, HuffmanNode*>(left, right)} {}
-    void clean()
+/*
+Number of streams writeStreams splits a block into
+*/
+#define STREAM_COUNT 4
+
+/*
+Bytes giving the size of each stream but the last at the start of a block
+*/
+#define STREAM_SIZE_BYTES 4
+
+/*
+One stream of a block being decoded. Its bits sit in a word loaded from the byte holding the next bit,
+so at least 57 bits can be looked at after each reload. Past the end of the stream 0-bits are read
+*/
+template <BitBuffer::BitOrder Order>
+struct SymbolStream {
+    const std::uint8_t *data;
+    size_t size;
+    size_t position;
+    size_t used;
+    std::uint64_t word;
+    
+    inline void reload()
     {
-        if (children.first != nullptr) {
-            children.first->clean();
-            delete children.first;
+        position += used >> 3;
+        used &= 7;
+        if (position + 8 <= size) {
+            word = Order == BitBuffer::MSB ? BitBuffer::loadBe64(data + position) : BitBuffer::loadLe64(data + position);
+            return;
         }
-        if (children.second != nullptr) {
-            children.second->clean();
-            delete children.second;
+        word = 0;
+        for (size_t i = position; i < size && i < position + 8; i++) {
+            size_t shift = (i - position) * 8;
+            word |= std::uint64_t{data[i]} << (Order == BitBuffer::MSB ? 56 - shift : shift);
         }
     }
-    bool operator<(HuffmanNode other)
+    
+    inline std::uint32_t peek(size_t bits) const
     {
-        if (frequency != other.frequency) {
-            return frequency > other.frequency;
+        if (Order == BitBuffer::MSB) {
+            return (word << used) >> (64 - bits);
         }
-        return symbol > other.symbol;
+        return (word >> used) & ((std::uint64_t{1} << bits) - 1);
+    }
+    
+    inline void consume(size_t bits)
+    {
+        used += bits;
+    }
+    
+    inline size_t bitsRead() const
+    {
+        return position * 8 + used;
     }
 };
 
+/*
+Finish decoding a code too long for the tables one bit at a time, from the bits of it already consumed.
+The stream is reloaded after, so the symbols decoded next have as many bits to look at as usual
+*/
+template <BitBuffer::BitOrder Order>
+static bool decodeBitwise(const Huffman::HuffmanCode& huffman, SymbolStream<Order>& stream, int code, size_t length, int& symbol)
+{
+    bool found = false;
+    while (!found && length < Huffman::MAX_CODE_LENGTH) {
+        if (stream.used > 56) {
+            stream.reload();
+        }
+        code = (code << 1) | stream.peek(1);
+        stream.consume(1);
+        length++;
+        found = huffman.read(code, length, symbol);
+    }
+    stream.reload();
+    return found;
+}
+
+template <BitBuffer::BitOrder Order>
+static inline bool decodeSymbol(const Huffman::HuffmanCode& huffman, SymbolStream<Order>& stream,
+    const Huffman::HuffmanTableEntry *table, size_t tableBits, int& symbol)
+{
+    std::uint32_t prefix = stream.peek(tableBits);
+    const Huffman::HuffmanTableEntry *entry = &table[prefix];
+    if (entry->subBits) {
+        stream.consume(tableBits);
+        entry = &table[entry->symbol + stream.peek(entry->subBits)];
+        if (__builtin_expect(entry->length == 0, 0)) {
+            if (Order == BitBuffer::LSB) {
+                prefix = BitBuffer::reverseBits(prefix, tableBits);
+            }
+            return decodeBitwise(huffman, stream, prefix, tableBits, symbol);
+        }
+    }
+    stream.consume(entry->length);
+    symbol = entry->symbol;
+    return entry->length != 0;
+}
+
+/*
+Decode one or two symbols at once, falling back on the single symbol table for long codes
+*/
+template <BitBuffer::BitOrder Order>
+static inline bool decodeSymbols(const Huffman::HuffmanCode& huffman, SymbolStream<Order>& stream,
+    const Huffman::HuffmanMultiEntry *multi, size_t multiBits,
+    const Huffman::HuffmanTableEntry *table, size_t tableBits, int *symbols, size_t& position)
+{
+    const Huffman::HuffmanMultiEntry *entry = &multi[stream.peek(multiBits)];
+    if (entry->count) {
+        // Writing both is cheaper than branching on the count, the caller leaving room for the second
+        symbols[position] = entry->symbols[0];
+        symbols[position + 1] = entry->symbols[1];
+        stream.consume(entry->length);
+        position += entry->count;
+        return true;
+    }
+    return decodeSymbol(huffman, stream, table, tableBits, symbols[position++]);
+}
+
 Huffman::HuffmanCode::HuffmanCode(std::vector<std::vector<int>>& symbolList)
 {
     initFromList(symbolList);
 }
 
-Huffman::HuffmanCode::HuffmanCode(std::map<int, int>& frequencies, size_t limit)
+Huffman::HuffmanCode::HuffmanCode(const std::map<int, int>& frequencies, size_t limit)
 {
-    std::vector<HuffmanNode> heap;
+    std::vector<std::pair<std::uint64_t, int>> sorted;
     for (auto it = frequencies.begin(); it != frequencies.end(); it++) {
-        heap.push_back(HuffmanNode(it->first, it->second));
-    }
-    std::make_heap(heap.begin(), heap.end());
-    while (heap.size() > 1) {
-        std::pop_heap(heap.begin(), heap.end());
-        HuffmanNode *right = new HuffmanNode(heap.back());
-        heap.pop_back();
-        std::pop_heap(heap.begin(), heap.end());
-        HuffmanNode *left = new HuffmanNode(heap.back());
-        heap.pop_back();
-        heap.push_back(HuffmanNode(left, right));
-        std::push_heap(heap.begin(), heap.end());
-    }
-    HuffmanNode root = heap[0];
-    std::queue<HuffmanNode> queue;
-    queue.push(root);
-    std::vector<std::pair<int, int>> sortedSyms;
-    std::vector<int> population;
-    while(!queue.empty()) {
-        HuffmanNode node = queue.front();
-        queue.pop();
-        if (node.children.first == nullptr) { // Leaf
-            sortedSyms.push_back(std::pair<int, int>(node.length, node.symbol));
-            while (population.size() < node.length) {
-                population.push_back(0);
-            }
-            population[node.length - 1]++;
-        }
-        else { // Internal
-            node.children.first->length = node.length + 1;
-            node.children.second->length = node.length + 1;
-            queue.push(*node.children.first);
-            queue.push(*node.children.second);
-        }
-    }
-    root.clean();
-    std::sort(sortedSyms.begin(), sortedSyms.end());
-    if (limit > 0) {
-        while (population.size() > limit) {
-            if (population.back() == 0) {
-                population.pop_back();
+        sorted.push_back(std::pair<std::uint64_t, int>(static_cast<std::uint32_t>(it->second), it->first));
+    }
+    std::sort(sorted.begin(), sorted.end());
+    size_t n = sorted.size();
+    std::vector<std::uint64_t> weights(n);
+    for (size_t i = 0; i < n; i++) {
+        weights[i] = sorted[i].first;
+    }
+    std::vector<std::uint8_t> lengths(n);
+    // Without a limit the optimal code is still taken when it is short enough
+    if (limit == 0 || limit > MAX_CODE_LENGTH) {
+        limit = MAX_CODE_LENGTH;
+    }
+    sortedLimitedCodeLengths(weights.data(), n, limit, lengths.data());
+    std::vector<std::vector<int>> symbolList;
+    for (size_t i = 0; i < n; i++) {
+        if (symbolList.size() < lengths[i]) {
+            symbolList.resize(lengths[i]);
+        }
+        symbolList[lengths[i] - 1].push_back(sorted[i].second);
+    }
+    // Codes of one length go to their symbols in increasing order
+    for (auto it = symbolList.begin(); it != symbolList.end(); it++) {
+        std::sort(it->begin(), it->end());
+    }
+    initFromList(symbolList);
+}
+
+Huffman::HuffmanCode::HuffmanCode(const std::uint32_t *histogram, size_t n, size_t limit)
+{
+    std::vector<std::uint8_t> lengths(n);
+    if (limit == 0 || limit > MAX_CODE_LENGTH) {
+        limit = MAX_CODE_LENGTH;
+    }
+    codeLengths(histogram, n, lengths.data(), limit);
+    initFromLengths(lengths.data(), n);
+}
+
+Huffman::HuffmanCode::HuffmanCode(const std::uint8_t *lengths, size_t n)
+{
+    initFromLengths(lengths, n);
+}
+
+void Huffman::HuffmanCode::initFromList(std::vector<std::vector<int>>& symbolList)
+{
+    size_t maxLength = symbolList.size();
+    while (maxLength > 0 && symbolList[maxLength - 1].empty()) {
+        maxLength--;
+    }
+    if (maxLength > MAX_CODE_LENGTH) {
+        throw HuffmanException("Code too long");
+    }
+    decode.assign(symbolList.begin(), symbolList.begin() + maxLength);
+    firstCodes.resize(maxLength);
+    encode.clear();
+    // Wide enough to step past the last code of length MAX_CODE_LENGTH
+    std::uint64_t code = 0;
+    for (size_t i = 0; i < maxLength; i++) {
+        firstCodes[i] = code;
+        for (size_t j = 0; j < decode[i].size(); j++) {
+            encode.push_back(std::make_pair(decode[i][j], std::pair<int, size_t>(code++, i + 1)));
+        }
+        code <<= 1;
+    }
+    // Sorted by symbol for lookups, a symbol listed twice keeping its last code
+    std::stable_sort(encode.begin(), encode.end(),
+        [](const std::pair<int, std::pair<int, size_t>>& a, const std::pair<int, std::pair<int, size_t>>& b) {
+            return a.first < b.first;
+        });
+    size_t kept = 0;
+    for (size_t i = 0; i < encode.size(); i++) {
+        if (kept > 0 && encode[kept - 1].first == encode[i].first) {
+            kept--;
+        }
+        encode[kept++] = encode[i];
+    }
+    encode.resize(kept);
+    buildDecodeTable();
+    buildEncodeTable();
+}
+
+void Huffman::HuffmanCode::initFromLengths(const std::uint8_t *lengths, size_t n)
+{
+    size_t maxLength = 0;
+    for (size_t symbol = 0; symbol < n; symbol++) {
+        maxLength = std::max<size_t>(maxLength, lengths[symbol]);
+    }
+    if (maxLength > MAX_CODE_LENGTH) {
+        throw HuffmanException("Code too long");
+    }
+    std::vector<size_t> counts(maxLength + 1, 0);
+    for (size_t symbol = 0; symbol < n; symbol++) {
+        counts[lengths[symbol]]++;
+    }
+    decode.assign(maxLength, std::vector<int>());
+    firstCodes.resize(maxLength);
+    std::uint64_t code = 0;
+    for (size_t length = 1; length <= maxLength; length++) {
+        firstCodes[length - 1] = code;
+        decode[length - 1].reserve(counts[length]);
+        code = (code + counts[length]) << 1;
+    }
+    // Going through the symbols in order leaves both the codes and the lookup sorted without sorting
+    encode.clear();
+    encode.reserve(n - counts[0]);
+    for (size_t symbol = 0; symbol < n; symbol++) {
+        size_t length = lengths[symbol];
+        if (length) {
+            std::vector<int>& symbols = decode[length - 1];
+            encode.push_back(std::make_pair(static_cast<int>(symbol),
+                std::pair<int, size_t>(firstCodes[length - 1] + symbols.size(), length)));
+            symbols.push_back(symbol);
+        }
+    }
+    buildDecodeTable();
+    buildEncodeTable();
+}
+
+void Huffman::HuffmanCode::buildDecodeTable()
+{
+    decodeTable.clear();
+    reversedDecodeTable.clear();
+    multiTable.clear();
+    reversedMultiTable.clear();
+    multiBits = 0;
+    tableBits = std::min(decode.size(), TABLE_BITS);
+    decodeTable.resize(size_t{1} << tableBits, HuffmanTableEntry{0, 0, 0});
+    // Codes that do not fit in the first level share a secondary table per prefix,
+    // sized for the longest code with that prefix but no more than TABLE_MAX_LENGTH bits in all
+    for (size_t length = tableBits + 1; length <= decode.size(); length++) {
+        size_t extra = std::min(length, TABLE_MAX_LENGTH) - tableBits;
+        for (size_t i = 0; i < decode[length - 1].size(); i++) {
+            size_t prefix = (firstCodes[length - 1] + i) >> (length - tableBits);
+            if (prefix < decodeTable.size()) {
+                decodeTable[prefix].subBits = extra;
+            }
+        }
+    }
+    for (size_t prefix = 0; prefix < (size_t{1} << tableBits); prefix++) {
+        HuffmanTableEntry& entry = decodeTable[prefix];
+        if (entry.subBits) {
+            entry.symbol = decodeTable.size();
+            entry.length = tableBits;
+            decodeTable.resize(decodeTable.size() + (size_t{1} << entry.subBits), HuffmanTableEntry{0, 0, 0});
+        }
+    }
+    for (size_t length = 1; length <= decode.size(); length++) {
+        for (size_t i = 0; i < decode[length - 1].size(); i++) {
+            size_t code = firstCodes[length - 1] + i;
+            // Longer codes keep the empty entries under their prefix, which send them to a bitwise search
+            if (code >> length || length > TABLE_MAX_LENGTH) {
                 continue;
             }
-            if (population.size() < 3) {
-                throw Huffman::HuffmanException("Limit too small");
+            size_t first, count;
+            HuffmanTableEntry leaf;
+            leaf.symbol = decode[length - 1][i];
+            leaf.subBits = 0;
+            if (length <= tableBits) {
+                leaf.length = length;
+                first = code << (tableBits - length);
+                count = size_t{1} << (tableBits - length);
             }
-            size_t key = population.size() - 3;
-            while (population[key] == 0) {
-                if (key == 0) {
-                    throw Huffman::HuffmanException("Limit too small");
-                }
-                key--;
+            else {
+                size_t extra = length - tableBits;
+                const HuffmanTableEntry& link = decodeTable[code >> extra];
+                leaf.length = extra;
+                code &= (size_t{1} << extra) - 1;
+                first = link.symbol + (code << (link.subBits - extra));
+                count = size_t{1} << (link.subBits - extra);
             }
-            population[population.size() - 1] -= 2;
-            population[population.size() - 2]++;
-            population[key + 1] += 2;
-            population[key]--;
+            std::fill(decodeTable.begin() + first, decodeTable.begin() + first + count, leaf);
         }
     }
-    std::vector<std::vector<int>> symbolList;
-    size_t length = 1;
-    for (auto it = sortedSyms.begin(); it != sortedSyms.end(); it++) {
-        while (population[length - 1] == 0) {
-            length++;
-        }
-        while (symbolList.size() < length) {
-            symbolList.push_back(std::vector<int>());
+    // The same entries, each level indexed by its bits in reverse
+    reversedDecodeTable.resize(decodeTable.size());
+    for (size_t prefix = 0; prefix < (size_t{1} << tableBits); prefix++) {
+        const HuffmanTableEntry& entry = decodeTable[prefix];
+        reversedDecodeTable[BitBuffer::reverseBits(prefix, tableBits)] = entry;
+        if (entry.subBits) {
+            for (size_t suffix = 0; suffix < (size_t{1} << entry.subBits); suffix++) {
+                reversedDecodeTable[entry.symbol + BitBuffer::reverseBits(suffix, entry.subBits)] = decodeTable[entry.symbol + suffix];
+            }
         }
-        symbolList[length - 1].push_back(it->second);
-        population[length - 1]--;
     }
-    initFromList(symbolList);
 }
 
-void Huffman::HuffmanCode::initFromList(std::vector<std::vector<int>>& symbolList)
+void Huffman::HuffmanCode::buildEncodeTable()
 {
-    int code = 0;
-    for (size_t i = 0; i < symbolList.size(); i++) {
-        std::vector<int>& symbols = symbolList[i];
-        size_t length = i + 1;
-        if (symbols.size() > 0) {
-            while (decode.size() < length) {
-                decode.push_back(std::map<int, int>());
+    encodeTable.clear();
+    reversedEncodeTable.clear();
+    auto first = std::lower_bound(encode.begin(), encode.end(), std::make_pair(0, std::pair<int, size_t>(0, 0)));
+    if (first == encode.end()) {
+        return;
+    }
+    size_t size = encode.back().first + size_t{1};
+    size_t symbols = std::distance(first, encode.end());
+    if (size > symbols * ENCODE_TABLE_SPREAD || decode.size() > ENCODE_TABLE_MAX_LENGTH) {
+        return;
+    }
+    encodeTable.resize(size, 0);
+    reversedEncodeTable.resize(size, 0);
+    for (auto it = first; it != encode.end(); it++) {
+        int code = it->second.first;
+        size_t length = it->second.second;
+        encodeTable[it->first] = (code << ENCODE_LENGTH_BITS) | length;
+        reversedEncodeTable[it->first] = (BitBuffer::reverseBits(code, length) << ENCODE_LENGTH_BITS) | length;
+    }
+}
+
+void Huffman::HuffmanCode::buildMultiSymbolTable(size_t bits)
+{
+    if (bits == 0 || bits > TABLE_MAX_LENGTH) {
+        throw HuffmanException("Table bits out of range");
+    }
+    multiBits = bits;
+    multiTable.assign(size_t{1} << bits, HuffmanMultiEntry{{0, 0}, 0, 0});
+    size_t longest = std::min(bits, decode.size());
+    for (size_t length = 1; length <= longest; length++) {
+        for (size_t i = 0; i < decode[length - 1].size(); i++) {
+            size_t code = firstCodes[length - 1] + i;
+            if (code >> length) {
+                continue;
             }
-            for (size_t j = 0; j < symbols.size(); j++) {
-                int symbol = symbols[j];
-                encode[symbol] = std::pair<int, size_t>(code, length);
-                decode[i][code++] = symbol;
+            int symbol = decode[length - 1][i];
+            size_t rest = bits - length;
+            size_t first = code << rest;
+            // On its own the symbol fills every entry starting with its code
+            for (size_t j = 0; j < (size_t{1} << rest); j++) {
+                multiTable[first + j] = HuffmanMultiEntry{{symbol, symbol},
+                    static_cast<std::uint8_t>(length), 1};
+            }
+            // then pairs with each code that fits in the bits left after it
+            for (size_t second = 1; second <= std::min(rest, decode.size()); second++) {
+                for (size_t m = 0; m < decode[second - 1].size(); m++) {
+                    size_t secondCode = firstCodes[second - 1] + m;
+                    if (secondCode >> second) {
+                        continue;
+                    }
+                    size_t start = first | (secondCode << (rest - second));
+                    for (size_t j = 0; j < (size_t{1} << (rest - second)); j++) {
+                        multiTable[start + j] = HuffmanMultiEntry{{symbol, decode[second - 1][m]},
+                            static_cast<std::uint8_t>(length + second), 2};
+                    }
+                }
             }
         }
-        code <<= 1;
     }
-    // for (size_t i = 0; i < decode.size(); i++) {
-        // std::map<int, int>& symbols = decode[i];
-        // for (auto it = symbols.begin(); it != symbols.end(); it++) {
-            // std::cout << it->second << ":(" << it->first << ',' << i + 1 << ")\n";
-        // }
-    // }
+    reversedMultiTable.resize(multiTable.size());
+    for (size_t index = 0; index < multiTable.size(); index++) {
+        reversedMultiTable[BitBuffer::reverseBits(index, bits)] = multiTable[index];
+    }
 }
 
 bool Huffman::HuffmanCode::write(int symbol, int& code, size_t& length) const
 {
-    auto it = encode.find(symbol);
-    if (it == encode.end()) {
+    if (static_cast<size_t>(symbol) < encodeTable.size()) {
+        std::uint32_t entry = encodeTable[symbol];
+        code = entry >> ENCODE_LENGTH_BITS;
+        length = entry & ((1 << ENCODE_LENGTH_BITS) - 1);
+        return length != 0;
+    }
+    auto it = std::lower_bound(encode.begin(), encode.end(), std::make_pair(symbol, std::pair<int, size_t>(0, 0)));
+    if (it == encode.end() || it->first != symbol) {
         return false;
     }
     code = it->second.first;
@@ -164,44 +405,154 @@ bool Huffman::HuffmanCode::write(int symbol, int& code, size_t& length) const
     return true;
 }
 
-bool Huffman::HuffmanCode::write(int symbol, BitBuffer::BitBufferOut& buffer) const
+bool Huffman::HuffmanCode::read(int code, size_t length, int& symbol) const
 {
-    int code;
-    size_t length;
-    if (!write(symbol, code, length)) {
-        // std::cout << "Symbol " << symbol << " not found\n";
+    if (length > decode.size() || length == 0) {
+        return false;
+    }
+    // Codes of one length are consecutive from the first
+    const std::vector<int>& symbols = decode[length - 1];
+    size_t index = code - firstCodes[length - 1];
+    if (code < firstCodes[length - 1] || index >= symbols.size()) {
         return false;
     }
-    // std::cout << "Writing " << code << " in " << length << std::endl;
-    buffer.write(code, length);
+    symbol = symbols[index];
     return true;
 }
 
-bool Huffman::HuffmanCode::read(int code, size_t length, int& symbol) const
+bool Huffman::HuffmanCode::writeStreams(const int *symbols, size_t n, std::vector<std::uint8_t>& out,
+    BitBuffer::BitOrder order) const
 {
-    if (length > decode.size() || length == 0) {
-        return false;
+    size_t start = out.size();
+    out.resize(start + (STREAM_COUNT - 1) * STREAM_SIZE_BYTES, 0);
+    size_t quarter = (n + STREAM_COUNT - 1) / STREAM_COUNT;
+    for (size_t k = 0; k < STREAM_COUNT; k++) {
+        size_t first = std::min(n, k * quarter);
+        size_t last = std::min(n, first + quarter);
+        size_t before = out.size();
+        bool valid = true;
+        {
+            BitBuffer::BitVectorOut buffer(out, order);
+            for (size_t i = first; i < last && valid; i++) {
+                valid = write(symbols[i], buffer);
+            }
+            buffer.flush();
+        }
+        if (!valid) {
+            out.resize(start);
+            return false;
+        }
+        if (k < STREAM_COUNT - 1) {
+            size_t length = out.size() - before;
+            for (size_t b = 0; b < STREAM_SIZE_BYTES; b++) {
+                out[start + k * STREAM_SIZE_BYTES + b] = length >> (8 * b);
+            }
+        }
     }
-    auto codes = decode[length - 1];
-    auto it = codes.find(code);
-    if (it == codes.end()) {
+    return true;
+}
+
+bool Huffman::HuffmanCode::readStreams(const std::uint8_t *data, size_t size, int *symbols, size_t n,
+    BitBuffer::BitOrder order) const
+{
+    size_t offset = (STREAM_COUNT - 1) * STREAM_SIZE_BYTES;
+    if (size < offset) {
         return false;
     }
-    symbol = it->second;
-    return true;
+    const std::uint8_t *starts[STREAM_COUNT];
+    const std::uint8_t *ends[STREAM_COUNT];
+    for (size_t k = 0; k < STREAM_COUNT; k++) {
+        // The last stream takes the rest of the block
+        size_t length = size - offset;
+        if (k < STREAM_COUNT - 1) {
+            length = 0;
+            for (size_t b = 0; b < STREAM_SIZE_BYTES; b++) {
+                length |= size_t{data[k * STREAM_SIZE_BYTES + b]} << (8 * b);
+            }
+            if (length > size - offset) {
+                return false;
+            }
+        }
+        starts[k] = data + offset;
+        offset += length;
+        ends[k] = data + offset;
+    }
+    if (order == BitBuffer::MSB) {
+        return readStreams<BitBuffer::MSB>(starts, ends, symbols, n);
+    }
+    return readStreams<BitBuffer::LSB>(starts, ends, symbols, n);
 }
 
-bool Huffman::HuffmanCode::read(BitBuffer::BitBufferIn& buffer, int& output) const
+template <BitBuffer::BitOrder Order>
+bool Huffman::HuffmanCode::readStreams(const std::uint8_t *const *starts, const std::uint8_t *const *ends, int *symbols, size_t n) const
 {
-    int code = 0;
-    for (size_t length = 1; length <= decode.size(); length++) {
-        code = (code << 1) | buffer.read(1);
-        if (read(code, length, output)) {
-            return true;
+    size_t quarter = (n + STREAM_COUNT - 1) / STREAM_COUNT;
+    SymbolStream<Order> streams[STREAM_COUNT];
+    size_t counts[STREAM_COUNT];
+    for (size_t k = 0; k < STREAM_COUNT; k++) {
+        streams[k] = SymbolStream<Order>{starts[k], static_cast<size_t>(ends[k] - starts[k]), 0, 0, 0};
+        streams[k].reload();
+        counts[k] = std::min(n, (k + 1) * quarter) - std::min(n, k * quarter);
+    }
+    bool valid = true;
+    if (tableBits) {
+        // Codes longer than TABLE_MAX_LENGTH reload their stream once decoded
+        static_assert(3 * TABLE_MAX_LENGTH <= 57, "three codes must fit in the bits after a reload");
+        const HuffmanTableEntry *table = Order == BitBuffer::LSB ? reversedDecodeTable.data() : decodeTable.data();
+        size_t positions[STREAM_COUNT] = {};
+        if (!multiTable.empty()) {
+            const HuffmanMultiEntry *multi = Order == BitBuffer::LSB ? reversedMultiTable.data() : multiTable.data();
+            // Each of the three lookups per reload may decode two symbols, so every stream needs room for six
+            for (;;) {
+                bool room = true;
+                for (size_t k = 0; k < STREAM_COUNT; k++) {
+                    room &= counts[k] - positions[k] >= 6;
+                }
+                if (!room) {
+                    break;
+                }
+                for (size_t k = 0; k < STREAM_COUNT; k++) {
+                    streams[k].reload();
+                }
+                for (size_t j = 0; j < 3; j++) {
+                    for (size_t k = 0; k < STREAM_COUNT; k++) {
+                        valid &= decodeSymbols(*this, streams[k], multi, multiBits, table, tableBits,
+                            symbols + k * quarter, positions[k]);
+                    }
+                }
+            }
+        }
+        else {
+            // The last stream is the shortest. Until it runs out, each stream decodes three symbols per reload,
+            // the four lookups of each round being independent of each other
+            size_t i = 0;
+            for (; i + 3 <= counts[STREAM_COUNT - 1]; i += 3) {
+                for (size_t k = 0; k < STREAM_COUNT; k++) {
+                    streams[k].reload();
+                }
+                for (size_t j = i; j < i + 3; j++) {
+                    for (size_t k = 0; k < STREAM_COUNT; k++) {
+                        valid &= decodeSymbol(*this, streams[k], table, tableBits, symbols[k * quarter + j]);
+                    }
+                }
+            }
+            std::fill(positions, positions + STREAM_COUNT, i);
+        }
+        for (size_t k = 0; k < STREAM_COUNT; k++) {
+            for (size_t j = positions[k]; j < counts[k]; j++) {
+                streams[k].reload();
+                valid &= decodeSymbol(*this, streams[k], table, tableBits, symbols[k * quarter + j]);
+            }
         }
-        // std::cout << "Read " << code << " of length " << length << " failed\n";
     }
-    return false;
+    else {
+        // Only a code with no symbols has no tables
+        valid = n == 0;
+    }
+    for (size_t k = 0; k < STREAM_COUNT; k++) {
+        valid &= streams[k].bitsRead() <= static_cast<size_t>(ends[k] - starts[k]) * 8;
+    }
+    return valid;
 }
 
 std::vector<size_t> Huffman::HuffmanCode::lengthCounts() const
@@ -215,19 +566,163 @@ std::vector<size_t> Huffman::HuffmanCode::lengthCounts() const
 
 std::vector<std::vector<int>> Huffman::HuffmanCode::orderedSymbols() const
 {
-    std::vector<std::vector<int>> ret;
-    for (auto it = decode.begin(); it != decode.end(); it++) {
-        const std::map<int, int>& m = *it;
-        std::vector<int> syms;
-        for (auto it2 = m.begin(); it2 != m.end(); it2++) {
-            syms.push_back(it2->second);
-        }
-        ret.push_back(syms);
-    }
-    return ret;
+    return decode;
 }
 
 const char* Huffman::HuffmanException::what()
 {
     return ("Huffman Exception: " + message).c_str();
 }
+
+void Huffman::sortedCodeLengths(std::uint64_t *weights, size_t n)
+{
+    if (n == 0) {
+        return;
+    }
+    if (n == 1) {
+        weights[0] = 1;
+        return;
+    }
+    // First pass, left to right: each internal node takes the place of a consumed weight,
+    // which becomes the index of its parent
+    weights[0] += weights[1];
+    size_t root = 0;
+    size_t leaf = 2;
+    for (size_t next = 1; next < n - 1; next++) {
+        if (leaf >= n || weights[root] < weights[leaf]) {
+            weights[next] = weights[root];
+            weights[root++] = next;
+        }
+        else {
+            weights[next] = weights[leaf++];
+        }
+        if (leaf >= n || (root < next && weights[root] < weights[leaf])) {
+            weights[next] += weights[root];
+            weights[root++] = next;
+        }
+        else {
+            weights[next] += weights[leaf++];
+        }
+    }
+    // Second pass, right to left: internal node depths from parent indices
+    weights[n - 2] = 0;
+    for (size_t next = n - 2; next-- > 0;) {
+        weights[next] = weights[weights[next]] + 1;
+    }
+    // Third pass, right to left: leaf depths from the number of internal nodes at each depth
+    size_t available = 1;
+    size_t used = 0;
+    std::uint64_t depth = 0;
+    size_t internal = n - 1;
+    size_t next = n;
+    while (available > 0) {
+        while (internal > 0 && weights[internal - 1] == depth) {
+            used++;
+            internal--;
+        }
+        while (available > used) {
+            weights[--next] = depth;
+            available--;
+        }
+        available = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+void Huffman::sortedLimitedCodeLengths(const std::uint64_t *weights, size_t n, size_t limit, std::uint8_t *lengths)
+{
+    if (n == 0) {
+        return;
+    }
+    if (limit == 0 || (limit < 64 && (std::uint64_t{1} << limit) < n)) {
+        throw HuffmanException("Limit too small");
+    }
+    // Without the limit the code is optimal anyway, and much cheaper to find
+    std::vector<std::uint64_t> depths(weights, weights + n);
+    sortedCodeLengths(depths.data(), n);
+    if (depths[0] <= limit) {
+        std::copy(depths.begin(), depths.end(), lengths);
+        return;
+    }
+    // Package-merge: the list for each length from limit up merges the weights with pairs of items
+    // of the list below, and only its first 2n - 2 items can ever be chosen.
+    // A prefix of such a list is a prefix of the weights and a prefix of the pairs, so it is enough
+    // to keep which of its items are weights
+    size_t items = 2 * n - 2;
+    // The weights end with one larger than any pair, so a run of them always stops before running out
+    const std::uint64_t none = ~std::uint64_t{0};
+    std::vector<std::uint64_t> leaves(weights, weights + n);
+    leaves.push_back(none);
+    std::vector<std::uint64_t> list(items);
+    std::vector<std::uint64_t> merged(items);
+    std::vector<std::uint8_t> isWeight(limit * items, 0);
+    size_t size = std::min(n, items);
+    std::copy(weights, weights + size, list.begin());
+    std::fill(isWeight.begin() + (limit - 1) * items, isWeight.begin() + (limit - 1) * items + size, 1);
+    for (size_t level = limit - 1; level-- > 0;) {
+        std::uint8_t *kinds = isWeight.data() + level * items;
+        size_t pairs = size / 2;
+        size = std::min(items, n + pairs);
+        // Each pair comes after the run of weights no greater than it
+        size_t leaf = 0;
+        size_t i = 0;
+        for (size_t pair = 0; i < size; pair++) {
+            std::uint64_t package = pair < pairs ? list[2 * pair] + list[2 * pair + 1] : none;
+            for (; leaves[leaf] <= package && i < size; i++) {
+                merged[i] = leaves[leaf++];
+                kinds[i] = 1;
+            }
+            if (i < size) {
+                merged[i] = package;
+                kinds[i++] = 0;
+            }
+        }
+        list.swap(merged);
+    }
+    // Every list the smallest weights are chosen from adds a bit to their codes
+    std::fill(lengths, lengths + n, 0);
+    size_t chosen = items;
+    for (size_t level = 0; level < limit && chosen; level++) {
+        const std::uint8_t *kinds = isWeight.data() + level * items;
+        size_t count = 0;
+        for (size_t i = 0; i < chosen; i++) {
+            count += kinds[i];
+        }
+        for (size_t i = 0; i < count; i++) {
+            lengths[i]++;
+        }
+        chosen = 2 * (chosen - count);
+    }
+    // Lengths come out non-increasing, as sortedCodeLengths gives them
+}
+
+size_t Huffman::codeLengths(const std::uint32_t *histogram, size_t n, std::uint8_t *lengths, size_t limit)
+{
+    // Each symbol that occurs sorts by its count, then by itself
+    std::vector<std::uint64_t> keys;
+    for (size_t symbol = 0; symbol < n; symbol++) {
+        lengths[symbol] = 0;
+        if (histogram[symbol]) {
+            keys.push_back((std::uint64_t{histogram[symbol]} << 32) | symbol);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    size_t used = keys.size();
+    std::vector<std::uint64_t> weights(used);
+    for (size_t i = 0; i < used; i++) {
+        weights[i] = keys[i] >> 32;
+    }
+    std::vector<std::uint8_t> sortedLengths(used);
+    if (limit > 0) {
+        sortedLimitedCodeLengths(weights.data(), used, limit, sortedLengths.data());
+    }
+    else {
+        sortedCodeLengths(weights.data(), used);
+        std::copy(weights.begin(), weights.end(), sortedLengths.begin());
+    }
+    for (size_t i = 0; i < used; i++) {
+        lengths[keys[i] & 0xFFFFFFFF] = sortedLengths[i];
+    }
+    return used ? sortedLengths[0] : 0;
+}
@@ -7,6 +7,7 @@ md5.cpp
 #include <sstream>
 
 #include <cstdint>
+#include <cstring>
 #include <algorithm>
 // #include <endian.h>
 #include "bitutil.hpp"
@@ -26,72 +27,149 @@ static const std::uint32_t SIN[MD5_SIN_SIZE] = {
      4149444226, 3174756917,  718787259, 3951481745
 };
 
-static const int SHIFTS[MD5_SIN_SIZE] = {
-    7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,
-    5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,
-    4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,
-    6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21
-};
+#define MD5_BLOCK_SIZE (Digest::MD5_BUFFER_SIZE * sizeof(std::uint32_t))
+
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_STEP(f, a, b, c, d, x, i, s) \
+    (a) += f((b), (c), (d)) + (x) + SIN[i]; \
+    (a) = (b) + (((a) << (s)) | ((a) >> (32 - (s))));
 
-void Digest::MD5Context::processBuffer()
+static inline std::uint32_t loadLe32(const std::uint8_t *src)
 {
-    // std::cout << "Processing buffer ";
-    // for (size_t i = 0; i < 16; i++) {
-        // std::cout << buffer[i] << ", ";
-    // }
-    // std::cout << std::endl;
-    std::uint32_t a1 = a, b1 = b, c1 = c, d1 = d;
-    for (int i = 0; i < 64; i++) {
-        int quarter = i >> 4;
-        std::uint32_t f;
-        size_t g;
-        switch (quarter) {
-            case 0:
-                f = (b1 & c1) | ((~b1) & d1);
-                g = i;
-                break;
-            case 1:
-                f = (d1 & b1) | ((~d1) & c1);
-                g = (5 * i + 1) & 15;
-                break;
-            case 2:
-                f = b1 ^ c1 ^ d1;
-                g = (3 * i + 5) & 15;
-                break;
-            case 3:
-                f = c1 ^ (b1 | ~d1);
-                g = (7 * i) & 15;
-                break;
+    return src[0] | (src[1] << 8) | (src[2] << 16) | (std::uint32_t{src[3]} << 24);
+}
+
+#ifdef __GNUC__
+#define MD5_INLINE inline __attribute__((always_inline))
+#else
+#define MD5_INLINE inline
+#endif
+
+/*
+The 64 steps of MD5 over one block of message words x.
+V is std::uint32_t, or a vector of them to run one message per lane
+*/
+template <class V>
+static MD5_INLINE void md5Rounds(V& a1, V& b1, V& c1, V& d1, const V *x)
+{
+    MD5_STEP(MD5_F, a1, b1, c1, d1, x[ 0],  0,  7)
+    MD5_STEP(MD5_F, d1, a1, b1, c1, x[ 1],  1, 12)
+    MD5_STEP(MD5_F, c1, d1, a1, b1, x[ 2],  2, 17)
+    MD5_STEP(MD5_F, b1, c1, d1, a1, x[ 3],  3, 22)
+    MD5_STEP(MD5_F, a1, b1, c1, d1, x[ 4],  4,  7)
+    MD5_STEP(MD5_F, d1, a1, b1, c1, x[ 5],  5, 12)
+    MD5_STEP(MD5_F, c1, d1, a1, b1, x[ 6],  6, 17)
+    MD5_STEP(MD5_F, b1, c1, d1, a1, x[ 7],  7, 22)
+    MD5_STEP(MD5_F, a1, b1, c1, d1, x[ 8],  8,  7)
+    MD5_STEP(MD5_F, d1, a1, b1, c1, x[ 9],  9, 12)
+    MD5_STEP(MD5_F, c1, d1, a1, b1, x[10], 10, 17)
+    MD5_STEP(MD5_F, b1, c1, d1, a1, x[11], 11, 22)
+    MD5_STEP(MD5_F, a1, b1, c1, d1, x[12], 12,  7)
+    MD5_STEP(MD5_F, d1, a1, b1, c1, x[13], 13, 12)
+    MD5_STEP(MD5_F, c1, d1, a1, b1, x[14], 14, 17)
+    MD5_STEP(MD5_F, b1, c1, d1, a1, x[15], 15, 22)
+    
+    MD5_STEP(MD5_G, a1, b1, c1, d1, x[ 1], 16,  5)
+    MD5_STEP(MD5_G, d1, a1, b1, c1, x[ 6], 17,  9)
+    MD5_STEP(MD5_G, c1, d1, a1, b1, x[11], 18, 14)
+    MD5_STEP(MD5_G, b1, c1, d1, a1, x[ 0], 19, 20)
+    MD5_STEP(MD5_G, a1, b1, c1, d1, x[ 5], 20,  5)
+    MD5_STEP(MD5_G, d1, a1, b1, c1, x[10], 21,  9)
+    MD5_STEP(MD5_G, c1, d1, a1, b1, x[15], 22, 14)
+    MD5_STEP(MD5_G, b1, c1, d1, a1, x[ 4], 23, 20)
+    MD5_STEP(MD5_G, a1, b1, c1, d1, x[ 9], 24,  5)
+    MD5_STEP(MD5_G, d1, a1, b1, c1, x[14], 25,  9)
+    MD5_STEP(MD5_G, c1, d1, a1, b1, x[ 3], 26, 14)
+    MD5_STEP(MD5_G, b1, c1, d1, a1, x[ 8], 27, 20)
+    MD5_STEP(MD5_G, a1, b1, c1, d1, x[13], 28,  5)
+    MD5_STEP(MD5_G, d1, a1, b1, c1, x[ 2], 29,  9)
+    MD5_STEP(MD5_G, c1, d1, a1, b1, x[ 7], 30, 14)
+    MD5_STEP(MD5_G, b1, c1, d1, a1, x[12], 31, 20)
+    
+    MD5_STEP(MD5_H, a1, b1, c1, d1, x[ 5], 32,  4)
+    MD5_STEP(MD5_H, d1, a1, b1, c1, x[ 8], 33, 11)
+    MD5_STEP(MD5_H, c1, d1, a1, b1, x[11], 34, 16)
+    MD5_STEP(MD5_H, b1, c1, d1, a1, x[14], 35, 23)
+    MD5_STEP(MD5_H, a1, b1, c1, d1, x[ 1], 36,  4)
+    MD5_STEP(MD5_H, d1, a1, b1, c1, x[ 4], 37, 11)
+    MD5_STEP(MD5_H, c1, d1, a1, b1, x[ 7], 38, 16)
+    MD5_STEP(MD5_H, b1, c1, d1, a1, x[10], 39, 23)
+    MD5_STEP(MD5_H, a1, b1, c1, d1, x[13], 40,  4)
+    MD5_STEP(MD5_H, d1, a1, b1, c1, x[ 0], 41, 11)
+    MD5_STEP(MD5_H, c1, d1, a1, b1, x[ 3], 42, 16)
+    MD5_STEP(MD5_H, b1, c1, d1, a1, x[ 6], 43, 23)
+    MD5_STEP(MD5_H, a1, b1, c1, d1, x[ 9], 44,  4)
+    MD5_STEP(MD5_H, d1, a1, b1, c1, x[12], 45, 11)
+    MD5_STEP(MD5_H, c1, d1, a1, b1, x[15], 46, 16)
+    MD5_STEP(MD5_H, b1, c1, d1, a1, x[ 2], 47, 23)
+    
+    MD5_STEP(MD5_I, a1, b1, c1, d1, x[ 0], 48,  6)
+    MD5_STEP(MD5_I, d1, a1, b1, c1, x[ 7], 49, 10)
+    MD5_STEP(MD5_I, c1, d1, a1, b1, x[14], 50, 15)
+    MD5_STEP(MD5_I, b1, c1, d1, a1, x[ 5], 51, 21)
+    MD5_STEP(MD5_I, a1, b1, c1, d1, x[12], 52,  6)
+    MD5_STEP(MD5_I, d1, a1, b1, c1, x[ 3], 53, 10)
+    MD5_STEP(MD5_I, c1, d1, a1, b1, x[10], 54, 15)
+    MD5_STEP(MD5_I, b1, c1, d1, a1, x[ 1], 55, 21)
+    MD5_STEP(MD5_I, a1, b1, c1, d1, x[ 8], 56,  6)
+    MD5_STEP(MD5_I, d1, a1, b1, c1, x[15], 57, 10)
+    MD5_STEP(MD5_I, c1, d1, a1, b1, x[ 6], 58, 15)
+    MD5_STEP(MD5_I, b1, c1, d1, a1, x[13], 59, 21)
+    MD5_STEP(MD5_I, a1, b1, c1, d1, x[ 4], 60,  6)
+    MD5_STEP(MD5_I, d1, a1, b1, c1, x[11], 61, 10)
+    MD5_STEP(MD5_I, c1, d1, a1, b1, x[ 2], 62, 15)
+    MD5_STEP(MD5_I, b1, c1, d1, a1, x[ 9], 63, 21)
+}
+
+void Digest::MD5Context::processBlocks(const std::uint8_t *data, size_t blocks)
+{
+    for (; blocks; blocks--, data += MD5_BLOCK_SIZE) {
+        std::uint32_t x[MD5_BUFFER_SIZE];
+        for (size_t i = 0; i < MD5_BUFFER_SIZE; i++) {
+            x[i] = loadLe32(data + 4 * i);
         }
-        f += a1 + SIN[i] + buffer[g];
-        a1 = d1;
-        d1 = c1;
-        c1 = b1;
-        b1 += (f << SHIFTS[i]) | (f >> (32 - SHIFTS[i]));
-        // std::cout << a1 << ' ' << b1 << ' ' << c1 << ' ' << d1 << ' ' << f << std::endl;
+        std::uint32_t a1 = a, b1 = b, c1 = c, d1 = d;
+        md5Rounds(a1, b1, c1, d1, x);
+        a += a1;
+        b += b1;
+        c += c1;
+        d += d1;
     }
-    a += a1;
-    b += b1;
-    c += c1;
-    d += d1;
-    std::fill(buffer, buffer + MD5_BUFFER_SIZE, 0);
 }
 
 void Digest::MD5Context::consume(const std::uint8_t *data, size_t n)
 {
-    for (size_t i = 0; i < n; i++) {
-        operator<<(data[i]);
+    bytesProcessed += n;
+    if (bufferIndex != 0) {
+        size_t take = std::min(n, MD5_BLOCK_SIZE - bufferIndex);
+        std::copy(data, data + take, buffer + bufferIndex);
+        bufferIndex += take;
+        data += take;
+        n -= take;
+        if (bufferIndex != MD5_BLOCK_SIZE) {
+            return;
+        }
+        processBlocks(buffer, 1);
+        bufferIndex = 0;
     }
+    size_t blocks = n / MD5_BLOCK_SIZE;
+    processBlocks(data, blocks);
+    data += blocks * MD5_BLOCK_SIZE;
+    n -= blocks * MD5_BLOCK_SIZE;
+    std::copy(data, data + n, buffer);
+    bufferIndex = n;
 }
 
 Digest::MD5Context& Digest::MD5Context::operator<<(std::uint8_t byte)
 {
     bytesProcessed++;
-    buffer[bufferIndex >> 2] |= byte << (8 * (bufferIndex & 3));
-    bufferIndex++;
-    if (bufferIndex == MD5_BUFFER_SIZE * 4) {
+    buffer[bufferIndex++] = byte;
+    if (bufferIndex == MD5_BLOCK_SIZE) {
         bufferIndex = 0;
-        processBuffer();
+        processBlocks(buffer, 1);
     }
     return *this;
 }
@@ -109,10 +187,9 @@ std::vector<std::uint8_t> Digest::MD5Context::finalize()
         (std::uint8_t)(bytesProcessed >> 45),
         (std::uint8_t)(bytesProcessed >> 53)
     };
-    operator<<(0x80);
-    while (bufferIndex != 56) {
-        operator<<(0x00);
-    }
+    static const std::uint8_t padding[MD5_BLOCK_SIZE] = {0x80};
+    size_t lengthIndex = MD5_BLOCK_SIZE - sizeof(std::uint64_t);
+    consume(padding, (bufferIndex < lengthIndex ? lengthIndex : MD5_BLOCK_SIZE + lengthIndex) - bufferIndex);
     consume(bits, sizeof(std::uint64_t));
     // std::uint32_t words[4] = {
         // htole32(a),
@@ -130,6 +207,147 @@ std::vector<std::uint8_t> Digest::MD5Context::finalize()
     };
 }
 
+/*
+Hash up to lanes messages side by side, one per lane of V
+
+order: Indices of the messages to hash
+*/
+template <class V>
+static MD5_INLINE void md5Group(const std::uint8_t *const *messages, const size_t *lengths,
+    const size_t *order, size_t count, std::uint8_t *digests)
+{
+    constexpr size_t lanes = sizeof(V) / sizeof(std::uint32_t);
+    static const std::uint8_t empty[MD5_BLOCK_SIZE] = {0};
+    // The last partial block, padding and length of each message
+    std::uint8_t tails[lanes][2 * MD5_BLOCK_SIZE];
+    size_t fullBlocks[lanes];
+    size_t totalBlocks[lanes];
+    size_t maxBlocks = 0;
+    for (size_t lane = 0; lane < lanes; lane++) {
+        if (lane >= count) {
+            fullBlocks[lane] = totalBlocks[lane] = 0;
+            continue;
+        }
+        size_t length = lengths[order[lane]];
+        size_t rem = length % MD5_BLOCK_SIZE;
+        fullBlocks[lane] = length / MD5_BLOCK_SIZE;
+        size_t tailBlocks = (rem + sizeof(std::uint64_t)) / MD5_BLOCK_SIZE + 1;
+        totalBlocks[lane] = fullBlocks[lane] + tailBlocks;
+        maxBlocks = std::max(maxBlocks, totalBlocks[lane]);
+        std::uint8_t *tail = tails[lane];
+        std::fill(tail, tail + tailBlocks * MD5_BLOCK_SIZE, 0);
+        std::copy(messages[order[lane]] + length - rem, messages[order[lane]] + length, tail);
+        tail[rem] = 0x80;
+        std::uint64_t bits = std::uint64_t{length} << 3;
+        for (size_t i = 0; i < sizeof(std::uint64_t); i++) {
+            tail[tailBlocks * MD5_BLOCK_SIZE - sizeof(std::uint64_t) + i] = bits >> (8 * i);
+        }
+    }
+    V a = V{} + Digest::MD5_A, b = V{} + Digest::MD5_B, c = V{} + Digest::MD5_C, d = V{} + Digest::MD5_D;
+    for (size_t block = 0; block < maxBlocks; block++) {
+        std::uint32_t words[Digest::MD5_BUFFER_SIZE][lanes];
+        std::uint32_t active[lanes];
+        for (size_t lane = 0; lane < lanes; lane++) {
+            const std::uint8_t *src = empty;
+            if (block < fullBlocks[lane]) {
+                src = messages[order[lane]] + block * MD5_BLOCK_SIZE;
+            }
+            else if (block < totalBlocks[lane]) {
+                src = tails[lane] + (block - fullBlocks[lane]) * MD5_BLOCK_SIZE;
+            }
+            for (size_t i = 0; i < Digest::MD5_BUFFER_SIZE; i++) {
+                words[i][lane] = loadLe32(src + 4 * i);
+            }
+            active[lane] = block < totalBlocks[lane] ? 0xFFFFFFFF : 0;
+        }
+        V x[Digest::MD5_BUFFER_SIZE];
+        V mask;
+        std::memcpy(x, words, sizeof(x));
+        std::memcpy(&mask, active, sizeof(mask));
+        V a1 = a, b1 = b, c1 = c, d1 = d;
+        md5Rounds(a1, b1, c1, d1, x);
+        a += a1 & mask;
+        b += b1 & mask;
+        c += c1 & mask;
+        d += d1 & mask;
+    }
+    std::uint32_t state[4][lanes];
+    std::memcpy(state[0], &a, sizeof(a));
+    std::memcpy(state[1], &b, sizeof(b));
+    std::memcpy(state[2], &c, sizeof(c));
+    std::memcpy(state[3], &d, sizeof(d));
+    for (size_t lane = 0; lane < count; lane++) {
+        std::uint8_t *digest = digests + order[lane] * Digest::MD5_DIGEST_SIZE;
+        for (size_t i = 0; i < Digest::MD5_DIGEST_SIZE; i++) {
+            digest[i] = state[i >> 2][lane] >> (8 * (i & 3));
+        }
+    }
+}
+
+#ifdef BITUTIL_X86_64
+
+typedef void (*Md5GroupFunction)(const std::uint8_t *const*, const size_t*, const size_t*, size_t, std::uint8_t*);
+
+typedef std::uint32_t Md5x4 __attribute__((vector_size(16)));
+typedef std::uint32_t Md5x8 __attribute__((vector_size(32)));
+typedef std::uint32_t Md5x16 __attribute__((vector_size(64)));
+
+static void md5GroupSse2(const std::uint8_t *const *messages, const size_t *lengths,
+    const size_t *order, size_t count, std::uint8_t *digests)
+{
+    md5Group<Md5x4>(messages, lengths, order, count, digests);
+}
+
+__attribute__((target("avx2")))
+static void md5GroupAvx2(const std::uint8_t *const *messages, const size_t *lengths,
+    const size_t *order, size_t count, std::uint8_t *digests)
+{
+    md5Group<Md5x8>(messages, lengths, order, count, digests);
+}
+
+__attribute__((target("avx512f")))
+static void md5GroupAvx512(const std::uint8_t *const *messages, const size_t *lengths,
+    const size_t *order, size_t count, std::uint8_t *digests)
+{
+    md5Group<Md5x16>(messages, lengths, order, count, digests);
+}
+
+#endif
+
+void Digest::md5Batch(const std::uint8_t *const *messages, const size_t *lengths, size_t count, std::uint8_t *digests)
+{
+#ifdef BITUTIL_X86_64
+    Md5GroupFunction group = md5GroupSse2;
+    size_t lanes = 4;
+    if (__builtin_cpu_supports("avx512f")) {
+        group = md5GroupAvx512;
+        lanes = 16;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        group = md5GroupAvx2;
+        lanes = 8;
+    }
+    // Hash messages of similar length together so that fewer lanes sit idle
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [lengths](size_t x, size_t y) {
+        return lengths[x] / MD5_BLOCK_SIZE < lengths[y] / MD5_BLOCK_SIZE;
+    });
+    for (size_t i = 0; i < count; i += lanes) {
+        group(messages, lengths, order.data() + i, std::min(lanes, count - i), digests);
+    }
+#else
+    for (size_t i = 0; i < count; i++) {
+        MD5Context context;
+        context.consume(messages[i], lengths[i]);
+        std::vector<std::uint8_t> digest = context.finalize();
+        std::copy(digest.begin(), digest.end(), digests + i * MD5_DIGEST_SIZE);
+    }
+#endif
+}
+
 // int main()
 // {
     // Digest::MD5Context md5;
@@ -10,8 +10,13 @@ Convert to UTF8
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
+#include <cstring>
 #include  "bitutil.hpp"
 
+#ifdef BITUTIL_X86_64
+#include <immintrin.h>
+#endif
+
 size_t BitManip::utf8(std::uint32_t v, std::uint8_t *dst)
 {
     size_t bytes;
@@ -48,7 +53,7 @@ size_t BitManip::utf8(std::uint32_t v, std::uint8_t *dst)
     return bytes;
 }
 
-size_t BitManip::utf8(std::uint8_t *src, std::uint32_t &v)
+size_t BitManip::utf8(const std::uint8_t *src, std::uint32_t &v)
 {
     std::uint8_t id = *src;
     size_t bytes = utf8BytesLeft(id) + 1;
@@ -70,6 +75,275 @@ size_t BitManip::utf8(std::uint8_t *src, std::uint32_t &v)
     return bytes;
 }
 
+/*
+Length of the valid sequence at the start of src, 0 if it is invalid or cut off
+*/
+static inline size_t sequenceLength(const std::uint8_t *src, size_t n)
+{
+    size_t length = BitManip::utf8BytesLeft(src[0]) + 1;
+    if (length > BitManip::UTF8_MAX_LEN || length > n) {
+        return 0;
+    }
+    for (size_t i = 1; i < length; i++) {
+        if ((src[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+/*
+Bulk kernels for runs of ASCII, which the bulk functions interleave with single multi-byte sequences.
+Each handles as much of the ASCII at the start of its input as it can and returns how much that was
+*/
+struct Utf8Kernels {
+    size_t (*asciiPrefix)(const std::uint8_t *src, size_t n);
+    size_t (*asciiWiden)(const std::uint8_t *src, size_t n, std::uint32_t *dst);
+    size_t (*asciiNarrow)(const std::uint32_t *src, size_t n, std::uint8_t *dst);
+};
+
+#define UTF8_ASCII_MASK 0x8080808080808080
+
+static size_t asciiPrefixScalar(const std::uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + sizeof(std::uint64_t) <= n; i += sizeof(std::uint64_t)) {
+        std::uint64_t word;
+        std::memcpy(&word, src + i, sizeof(word));
+        if (word & UTF8_ASCII_MASK) {
+            break;
+        }
+    }
+    while (i < n && src[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+static size_t asciiWidenScalar(const std::uint8_t *src, size_t n, std::uint32_t *dst)
+{
+    size_t i = 0;
+    for (; i < n && src[i] < 0x80; i++) {
+        dst[i] = src[i];
+    }
+    return i;
+}
+
+static size_t asciiNarrowScalar(const std::uint32_t *src, size_t n, std::uint8_t *dst)
+{
+    size_t i = 0;
+    for (; i < n && src[i] < 0x80; i++) {
+        dst[i] = src[i];
+    }
+    return i;
+}
+
+#ifdef BITUTIL_X86_64
+
+__attribute__((target("sse4.1")))
+static size_t asciiPrefixSse(const std::uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + asciiPrefixScalar(src + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static size_t asciiWidenSse(const std::uint8_t *src, size_t n, std::uint32_t *dst)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        if (_mm_movemask_epi8(bytes)) {
+            break;
+        }
+        __m128i *out = reinterpret_cast<__m128i*>(dst + i);
+        _mm_storeu_si128(out, _mm_cvtepu8_epi32(bytes));
+        _mm_storeu_si128(out + 1, _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+        _mm_storeu_si128(out + 2, _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+        _mm_storeu_si128(out + 3, _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12)));
+    }
+    return i + asciiWidenScalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("sse4.1")))
+static size_t asciiNarrowSse(const std::uint32_t *src, size_t n, std::uint8_t *dst)
+{
+    const __m128i high = _mm_set1_epi32(~0x7F);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i *in = reinterpret_cast<const __m128i*>(src + i);
+        __m128i a = _mm_loadu_si128(in);
+        __m128i b = _mm_loadu_si128(in + 1);
+        __m128i c = _mm_loadu_si128(in + 2);
+        __m128i d = _mm_loadu_si128(in + 3);
+        if (!_mm_testz_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), high)) {
+            break;
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_packus_epi32(c, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), bytes);
+    }
+    return i + asciiNarrowScalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2")))
+static size_t asciiPrefixAvx2(const std::uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        int mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + asciiPrefixScalar(src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t asciiWidenAvx2(const std::uint8_t *src, size_t n, std::uint32_t *dst)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        if (_mm256_movemask_epi8(bytes)) {
+            break;
+        }
+        __m128i low = _mm256_castsi256_si128(bytes);
+        __m128i high = _mm256_extracti128_si256(bytes, 1);
+        __m256i *out = reinterpret_cast<__m256i*>(dst + i);
+        _mm256_storeu_si256(out, _mm256_cvtepu8_epi32(low));
+        _mm256_storeu_si256(out + 1, _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)));
+        _mm256_storeu_si256(out + 2, _mm256_cvtepu8_epi32(high));
+        _mm256_storeu_si256(out + 3, _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8)));
+    }
+    return i + asciiWidenScalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2")))
+static size_t asciiNarrowAvx2(const std::uint32_t *src, size_t n, std::uint8_t *dst)
+{
+    const __m256i high = _mm256_set1_epi32(~0x7F);
+    // Packing works within 128-bit lanes, this puts the dwords of bytes back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i *in = reinterpret_cast<const __m256i*>(src + i);
+        __m256i a = _mm256_loadu_si256(in);
+        __m256i b = _mm256_loadu_si256(in + 1);
+        __m256i c = _mm256_loadu_si256(in + 2);
+        __m256i d = _mm256_loadu_si256(in + 3);
+        if (!_mm256_testz_si256(_mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d)), high)) {
+            break;
+        }
+        __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(a, b), _mm256_packus_epi32(c, d));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_permutevar8x32_epi32(bytes, order));
+    }
+    return i + asciiNarrowScalar(src + i, n - i, dst + i);
+}
+
+#endif
+
+static Utf8Kernels pickUtf8Kernels()
+{
+#ifdef BITUTIL_X86_64
+    if (__builtin_cpu_supports("avx2")) {
+        return Utf8Kernels{asciiPrefixAvx2, asciiWidenAvx2, asciiNarrowAvx2};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return Utf8Kernels{asciiPrefixSse, asciiWidenSse, asciiNarrowSse};
+    }
+#endif
+    return Utf8Kernels{asciiPrefixScalar, asciiWidenScalar, asciiNarrowScalar};
+}
+
+static const Utf8Kernels& utf8Kernels()
+{
+    static const Utf8Kernels kernels = pickUtf8Kernels();
+    return kernels;
+}
+
+size_t BitManip::utf8Validate(const std::uint8_t *src, size_t n)
+{
+    const Utf8Kernels& kernels = utf8Kernels();
+    size_t i = 0;
+    while (i < n) {
+        if (src[i] < 0x80) {
+            i += kernels.asciiPrefix(src + i, n - i);
+            continue;
+        }
+        size_t length = sequenceLength(src + i, n - i);
+        if (length == 0) {
+            break;
+        }
+        i += length;
+    }
+    return i;
+}
+
+size_t BitManip::utf8Count(const std::uint8_t *src, size_t n)
+{
+    const Utf8Kernels& kernels = utf8Kernels();
+    size_t count = 0;
+    size_t i = 0;
+    while (i < n) {
+        if (src[i] < 0x80) {
+            size_t ascii = kernels.asciiPrefix(src + i, n - i);
+            i += ascii;
+            count += ascii;
+            continue;
+        }
+        size_t length = sequenceLength(src + i, n - i);
+        if (length == 0) {
+            break;
+        }
+        i += length;
+        count++;
+    }
+    return count;
+}
+
+size_t BitManip::utf8ToUtf32(const std::uint8_t *src, size_t n, std::uint32_t *dst)
+{
+    const Utf8Kernels& kernels = utf8Kernels();
+    size_t count = 0;
+    size_t i = 0;
+    while (i < n) {
+        if (src[i] < 0x80) {
+            size_t ascii = kernels.asciiWiden(src + i, n - i, dst + count);
+            i += ascii;
+            count += ascii;
+            continue;
+        }
+        if (sequenceLength(src + i, n - i) == 0) {
+            break;
+        }
+        i += utf8(src + i, dst[count++]);
+    }
+    return count;
+}
+
+size_t BitManip::utf32ToUtf8(const std::uint32_t *src, size_t n, std::uint8_t *dst)
+{
+    const Utf8Kernels& kernels = utf8Kernels();
+    size_t written = 0;
+    size_t i = 0;
+    while (i < n) {
+        if (src[i] < 0x80) {
+            size_t ascii = kernels.asciiNarrow(src + i, n - i, dst + written);
+            i += ascii;
+            written += ascii;
+            continue;
+        }
+        written += utf8(src[i++], dst + written);
+    }
+    return written;
+}
+
 // int main(int argc, char **argv)
 // {
     // constexpr size_t num = 10;